@@ -1,14 +1,21 @@
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
 #include <climits>
+#include <cmath>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
-#include <list>
-#include <map>
+#include <deque>
+#include <functional>
+#include <future>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 #include <cxxopts.hpp>
 
@@ -36,8 +43,7 @@
 #define TRACE(fmt, ...)
 // #define TRACE(fmt, ...) fprintf(stdout, "TRACE: " fmt "\n", ##__VA_ARGS__);
 
-constexpr size_t BUFSIZE = 1 << 15;  // 1 << 10;
-constexpr size_t BLOCKSIZE = 1 << 15;
+constexpr size_t CHUNKSIZE = 1 << 15;  // input matched per call to analyze_block*
 constexpr int NumHeaderCodeLengths = 19;
 constexpr int LiteralCodes = 256;  // [0, 255] doesn't include END_BLOCK code
 constexpr int LengthCodes = 29;    // [257, 285]
@@ -51,6 +57,24 @@ constexpr int MaxMatchLength = 258;
 constexpr int MinMatchDistance = 1;
 constexpr int MaxMatchDistance = 32768;
 constexpr int MaxBits = 15;
+constexpr int WindowBits = 15;
+constexpr int WindowSize = 1 << WindowBits;
+constexpr int WindowMask = WindowSize - 1;
+constexpr int HashBits = 15;
+constexpr uint32_t HashSize = 1u << HashBits;
+constexpr uint32_t HashMask = HashSize - 1;
+// every byte is shifted out of the hash after MinMatchLength updates
+constexpr int HashShift = (HashBits + MinMatchLength - 1) / MinMatchLength;
+static_assert(CHUNKSIZE <= WindowSize, "a chunk plus its history has to fit in the window buffer");
+// Blocks end after at most MaxBlockSymbols LZ77 symbols, or earlier at a
+// multiple of SplitInterval symbols if the statistics of the next
+// SplitInterval symbols differ enough from the block so far that a new
+// block is expected to save more than SplitMinSavings bits.
+constexpr size_t MaxBlockSymbols = 1 << 15;
+constexpr size_t SplitInterval = 1 << 12;
+constexpr double SplitMinSavings = 1024.0;
+// input compressed per job with -p, see `compress_parallel`
+constexpr size_t ParallelChunkSize = 1 << 17;
 constexpr uint8_t ID1_GZIP = 31;
 constexpr uint8_t ID2_GZIP = 139;
 constexpr uint8_t CM_DEFLATE = 8;
@@ -84,6 +108,89 @@ struct FileHandle {
     FILE* fp;
 };
 
+// Lock-free ring buffer for one producer and one consumer thread. `push`
+// and `pop` wait while the ring is full or empty, spinning briefly and then
+// sleeping, which is what holds back whichever side is ahead.
+template <typename T, size_t Capacity>
+struct SpscRing {
+    static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of 2");
+
+    bool try_push(const T& item) noexcept {
+        const size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_.load(std::memory_order_acquire) == Capacity) {
+            return false;
+        }
+        items_[tail & (Capacity - 1)] = item;
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool try_pop(T& item) noexcept {
+        const size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tail_.load(std::memory_order_acquire)) {
+            return false;
+        }
+        item = items_[head & (Capacity - 1)];
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    void push(const T& item) noexcept {
+        for (int spins = 0; !try_push(item); ++spins) {
+            backoff(spins);
+        }
+    }
+
+    T pop() noexcept {
+        T item;
+        for (int spins = 0; !try_pop(item); ++spins) {
+            backoff(spins);
+        }
+        return item;
+    }
+
+    static void backoff(int spins) noexcept {
+        if (spins < 64) {
+            std::this_thread::yield();
+        } else {
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+    }
+
+    alignas(64) std::atomic<size_t> head_{0};  // next item to pop, only written by the consumer
+    alignas(64) std::atomic<size_t> tail_{0};  // next slot to push, only written by the producer
+    T items_[Capacity];
+};
+
+// Passes buffers of `buffer_size` bytes from a producer thread to a consumer
+// thread. Filled buffers go one way and the consumer hands them back empty
+// the other way, so nothing is allocated after the start and the producer
+// waits once all PipeBuffers are filled. A buffer with size 0 marks the end.
+struct BufferPipe {
+    static constexpr size_t PipeBuffers = 8;
+
+    struct Buffer {
+        uint8_t* data;
+        size_t size;
+    };
+
+    explicit BufferPipe(size_t buffer_size) : storage(PipeBuffers * buffer_size), capacity{buffer_size} {
+        for (size_t i = 0; i < PipeBuffers; ++i) {
+            empty.push({&storage[i * buffer_size], 0});
+        }
+    }
+
+    Buffer get_empty() noexcept { return empty.pop(); }
+    void put_filled(Buffer buffer) noexcept { filled.push(buffer); }
+    Buffer get_filled() noexcept { return filled.pop(); }
+    void put_empty(Buffer buffer) noexcept { empty.push(buffer); }
+
+    std::vector<uint8_t> storage;
+    size_t capacity;
+    SpscRing<Buffer, PipeBuffers> filled;
+    SpscRing<Buffer, PipeBuffers> empty;
+};
+
 enum class Flags : uint8_t {
     FTEXT = 1u << 0,
     FHCRC = 1u << 1,
@@ -107,6 +214,18 @@ enum class BType : uint8_t {
     RESERVED = 0x3u,
 };
 
+// How much of the pending input `emit_blocks` has to write out, like zlib's
+// flush modes:
+// NONE   - only the blocks whose end is known
+// SYNC   - everything, followed by an empty stored block so the output ends
+//          on a byte boundary and more blocks can be appended
+// FINISH - everything, the last block is marked final
+enum class Flush : uint8_t {
+    NONE,
+    SYNC,
+    FINISH,
+};
+
 void xwrite(const void* ptr, size_t size, size_t nmemb, FILE* stream) {
     if (fwrite(ptr, size, nmemb, stream) != nmemb) {
         panic("short write");
@@ -128,93 +247,101 @@ struct Tree {
     int n_dists;
 };
 
-// TODO: use Code
-struct TreeNode {
-    TreeNode(int v, int b) noexcept : value{v}, codelen{b} {}
-    int value;
-    int codelen;
-};
-
-struct Node {
-    Node(int v, int w) : value{v}, weight{w} {}
-    int value;
-    int weight;
-    Node* left = nullptr;
-    Node* right = nullptr;
-    int depth = -1;
-};
-
-struct NodeCmp {
-    bool operator()(const Node* a, const Node* b) {
-        // STL heap api is for a max heap and expects less than comparison
-        return a->weight > b->weight;
+// Sets `codelens[value]` to the length of the huffman code for each of the
+// `n_values` values, with frequencies `counts`, such that no code is longer
+// than `max_bits`. Values that never occur get length 0.
+//
+// The tree is built with two queues over the leaves sorted by frequency,
+// internal nodes are created in order of increasing weight so they need no
+// heap. If it ends up too deep, the lengths are limited the same way as
+// miniz's tdefl_huffman_enforce_max_code_size: clamp to `max_bits`, then
+// lengthen shorter codes until the Kraft sum fits again. Lengths are handed
+// out from the number of codes of each length, shortest to the most frequent
+// values.
+void build_code_lengths(const uint32_t* counts, int n_values, int max_bits, uint8_t* codelens) {
+    constexpr int MaxValues = LitCodes;
+    assert(0 < n_values && n_values <= MaxValues);
+    assert(0 < max_bits && max_bits <= MaxBits);
+    uint16_t leaves[MaxValues];
+    uint32_t weight[2 * MaxValues];
+    uint16_t parent[2 * MaxValues];
+    uint16_t depth[2 * MaxValues];
+
+    std::fill(codelens, codelens + n_values, 0);
+    int n = 0;
+    for (int value = 0; value < n_values; ++value) {
+        if (counts[value] != 0) {
+            leaves[n++] = static_cast<uint16_t>(value);
+        }
     }
-};
-
-void assign_depth(Node* n, int depth) {
-    if (!n) return;
-    assign_depth(n->left, depth + 1);
-    n->depth = depth;
-    // printf("n: value=%d weight=%d depth=%d\n", n->value, n->weight, depth);
-    assign_depth(n->right, depth + 1);
-}
-
-std::map<int, int> count_values(const int* values, size_t n_values) {
-    std::map<int, int> counts;
-    for (size_t i = 0; i < n_values; ++i) {
-        counts[values[i]]++;
+    if (n <= 1) {
+        // a single code still needs a bit
+        codelens[n == 0 ? 0 : leaves[0]] = 1;
+        return;
+    }
+    assert(n <= (1 << max_bits));
+    std::sort(leaves, leaves + n, [counts](uint16_t a, uint16_t b) {
+        return counts[a] != counts[b] ? counts[a] < counts[b] : a < b;
+    });
+    for (int i = 0; i < n; ++i) {
+        weight[i] = counts[leaves[i]];
     }
-    return counts;
-}
 
-std::vector<TreeNode> construct_huffman_tree(const std::map<int, int>& counts) {
-    // TODO: max number of nodes is 2*N + 1?
-    std::list<Node> pool;
-    std::vector<Node*> nodes;
-    for (auto&& [value, count] : counts) {
-        assert(0 <= value);
-        assert(count > 0);
-        auto& n = pool.emplace_back(value, count);
-        n.left = n.right = nullptr;
-        nodes.push_back(&n);
-    }
-
-    auto&& pop_heap = [](std::vector<Node*>& nodes) {
-        std::pop_heap(nodes.begin(), nodes.end(), NodeCmp{});
-        nodes.pop_back();
+    // nodes [0, n) are the leaves, [n, 2n - 1) the internal nodes in the order
+    // they are created, the root last
+    int next_leaf = 0;
+    int next_node = n;
+    auto take_min = [&](int end) {
+        if (next_leaf < n && (next_node >= end || weight[next_leaf] <= weight[next_node])) {
+            return next_leaf++;
+        }
+        return next_node++;
     };
-
-    std::make_heap(nodes.begin(), nodes.end(), NodeCmp{});
-    while (nodes.size() >= 2) {
-        Node* a = nodes[0];
-        pop_heap(nodes);
-        Node* b = nodes[0];
-        pop_heap(nodes);
-        auto& n = pool.emplace_back(-1, a->weight + b->weight);
-        n.left = a;
-        n.right = b;
-        nodes.push_back(&n);
-        std::push_heap(nodes.begin(), nodes.end(), NodeCmp{});
+    for (int node = n; node < 2 * n - 1; ++node) {
+        const int a = take_min(node);
+        const int b = take_min(node);
+        weight[node] = weight[a] + weight[b];
+        parent[a] = parent[b] = static_cast<uint16_t>(node);
+    }
+    const int root = 2 * n - 2;
+    depth[root] = 0;
+    for (int node = root - 1; node >= 0; --node) {
+        depth[node] = depth[parent[node]] + 1;
     }
 
-    assert(nodes.size() == 1);
-    assign_depth(nodes[0], 0);
-
-    std::vector<TreeNode> result;
-    for (auto&& node : pool) {
-        if (node.value != -1) {
-            result.emplace_back(node.value, node.depth);
+    int bl_count[MaxBits + 1] = {};
+    bool overflow = false;
+    for (int i = 0; i < n; ++i) {
+        overflow |= depth[i] > max_bits;
+        bl_count[std::min<int>(depth[i], max_bits)]++;
+    }
+    if (overflow) {
+        uint32_t total = 0;
+        for (int bits = 1; bits <= max_bits; ++bits) {
+            total += static_cast<uint32_t>(bl_count[bits]) << (max_bits - bits);
+        }
+        while (total != (1u << max_bits)) {
+            bl_count[max_bits]--;
+            for (int bits = max_bits - 1; bits > 0; --bits) {
+                if (bl_count[bits] != 0) {
+                    bl_count[bits]--;
+                    bl_count[bits + 1] += 2;
+                    break;
+                }
+            }
+            total--;
         }
     }
 
-    if (result.empty()) {
-        result.push_back({0, 1});
-    } else if (result[0].codelen == 0) {
-        assert(result.size() == 1);
-        result[0].codelen = 1;
+    // the leaves are sorted by increasing frequency, so they get the longest
+    // codes first
+    int i = 0;
+    for (int bits = max_bits; bits > 0; --bits) {
+        for (int k = 0; k < bl_count[bits]; ++k) {
+            codelens[leaves[i++]] = static_cast<uint8_t>(bits);
+        }
     }
-
-    return result;
+    assert(i == n);
 }
 
 struct DynamicCodeLengths {
@@ -250,8 +377,8 @@ uint16_t flip_code(uint16_t code, size_t codelen) {
 }
 
 void init_huffman_tree(const uint8_t* codelens, int n_values, uint16_t* out_codes) {
-    size_t bl_count[MaxBits];
-    uint16_t next_code[MaxBits];
+    size_t bl_count[MaxBits + 1];
+    uint16_t next_code[MaxBits + 1];
 
     // 1) Count the number of codes for each code length. Let bl_count[N] be the
     // number of codes of length N, N >= 1.
@@ -301,53 +428,101 @@ void init_huffman_tree(const uint8_t* codelens, int n_values, uint16_t* out_code
 //  3. Everything else is least significant -> most significant
 
 struct BitWriter {
-    using Buffer = uint32_t;
-    constexpr static size_t BufferSizeInBits = 32;
+    using Buffer = uint64_t;
+    constexpr static size_t BufferSizeInBits = 64;
+    // a literal/length code, distance code and both their extra bits, 48 bits
+    // at most, go out in one call
+    constexpr static size_t MaxWriteBits = BufferSizeInBits - 8;
+    // output is collected in memory and handed to stdio this much at a time
+    constexpr static size_t BlockSize = 1 << 17;
+    // `_spill` can go up to 7 bytes past BlockSize before the block is drained
+    constexpr static size_t PipeBufferSize = BlockSize + sizeof(Buffer);
     static_assert((sizeof(Buffer) * CHAR_BIT) >= BufferSizeInBits);
 
-    BitWriter(FILE* fp) noexcept : out_{fp} {}
+    BitWriter(FILE* fp) : block_(BlockSize + sizeof(Buffer)), out_{fp} {}
+    // collects the output in `sink` instead of writing it to a file
+    BitWriter(std::vector<uint8_t>& sink) : block_(BlockSize + sizeof(Buffer)), sink_{&sink} {}
+    // hands the output to another thread through `pipe`, whose buffers have
+    // to hold PipeBufferSize bytes
+    BitWriter(BufferPipe& pipe) : block_(BlockSize + sizeof(Buffer)), pipe_{&pipe} {
+        assert(pipe.capacity >= PipeBufferSize);
+    }
 
-    void write_bits(uint16_t val, size_t n_bits) noexcept {
+    void write_bits(Buffer val, size_t n_bits) noexcept {
         total_written += n_bits;
-        assert(n_bits <= MaxBits);
-        if (bits_ == BufferSizeInBits) {
-            _write_full_buffer();
-        }
-        auto room = BufferSizeInBits - bits_;
-        if (room >= n_bits) {
-            buff_ |= val << bits_;
-            bits_ += n_bits;
-        } else {
-            auto n1 = std::min(room, n_bits);
-            auto n2 = n_bits - n1;
-            buff_ |= (val & _ones_mask(n1)) << bits_;
-            bits_ += n1;
-            _write_full_buffer();
-            assert(bits_ == 0);
-            buff_ |= val >> n1;
-            bits_ += n2;
+        assert(n_bits <= MaxWriteBits);
+        assert((val & ~_ones_mask(n_bits)) == 0);
+        if (bits_ + n_bits >= BufferSizeInBits) {
+            _spill();
         }
-        assert(bits_ <= BufferSizeInBits);
+        buff_ |= val << bits_;
+        bits_ += n_bits;
+        assert(bits_ < BufferSizeInBits);
     }
 
     void write(const void* p, size_t size) noexcept {
         total_written += 8 * size;
-        flush();
-        xwrite(p, 1, size, out_);
+        align();
+        auto* src = static_cast<const uint8_t*>(p);
+        while (size > 0) {
+            auto n = std::min(size, BlockSize - pos_);
+            memcpy(&block_[pos_], src, n);
+            pos_ += n;
+            src += n;
+            size -= n;
+            if (pos_ == BlockSize) {
+                _drain();
+            }
+        }
     }
 
+    // pads with zero bits up to the next byte boundary
+    void align() noexcept {
+        bits_ = (bits_ + 7) & ~size_t{7};
+        _spill();
+        assert(bits_ == 0);
+    }
+
+    // aligns and writes everything so far to the file, sink or pipe
     void flush() noexcept {
-        auto n_bytes = (bits_ + 7) / 8;
-        xwrite(&buff_, 1, n_bytes, out_);
-        buff_ = 0;
-        bits_ = 0;
+        align();
+        _drain();
     }
 
-    void _write_full_buffer() noexcept {
-        assert(bits_ == BufferSizeInBits);
-        xwrite(&buff_, sizeof(buff_), 1, out_);
-        buff_ = 0;
-        bits_ = 0;
+    // moves the whole bytes of `buff_` into the block, the store is always
+    // of all 8 bytes, least significant first, which the slack at the end of
+    // the block allows for
+    void _spill() noexcept {
+        const size_t n_bytes = bits_ / 8;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        const Buffer le = __builtin_bswap64(buff_);
+        memcpy(&block_[pos_], &le, sizeof(le));
+#else
+        memcpy(&block_[pos_], &buff_, sizeof(buff_));
+#endif
+        pos_ += n_bytes;
+        buff_ = n_bytes == sizeof(buff_) ? 0 : buff_ >> (8 * n_bytes);
+        bits_ -= 8 * n_bytes;
+        if (pos_ >= BlockSize) {
+            _drain();
+        }
+    }
+
+    void _drain() noexcept {
+        if (pos_ == 0) {
+            return;
+        }
+        if (pipe_) {
+            BufferPipe::Buffer buffer = pipe_->get_empty();
+            memcpy(buffer.data, block_.data(), pos_);
+            buffer.size = pos_;
+            pipe_->put_filled(buffer);
+        } else if (sink_) {
+            sink_->insert(sink_->end(), block_.begin(), block_.begin() + pos_);
+        } else {
+            xwrite(block_.data(), 1, pos_, out_);
+        }
+        pos_ = 0;
     }
 
     static constexpr Buffer _ones_mask(size_t n_bits) noexcept {
@@ -355,69 +530,37 @@ struct BitWriter {
         if (n_bits == BufferSizeInBits) {
             return static_cast<Buffer>(-1);
         } else {
-            return static_cast<Buffer>((1u << n_bits) - 1);
+            return (Buffer{1} << n_bits) - 1;
         }
     }
 
     Buffer buff_ = 0;
     size_t bits_ = 0;
+    std::vector<uint8_t> block_;
+    size_t pos_ = 0;
     FILE* out_ = nullptr;
+    std::vector<uint8_t>* sink_ = nullptr;
+    BufferPipe* pipe_ = nullptr;
     uint64_t total_written = 0;
 };
 
-void blkwrite_no_compression(const uint8_t* const buffer, size_t size, uint8_t bfinal, BitWriter& out) {
+void blkwrite_no_compression(const uint8_t* buffer, size_t size, uint8_t bfinal, BitWriter& out) {
     uint8_t block_type = static_cast<uint8_t>(BType::NO_COMPRESSION);
-    uint8_t btype = static_cast<uint8_t>(BType::NO_COMPRESSION);
-    xassert(size < UINT16_MAX, "invalid size: %zu", size);
-    uint16_t len = size;  //  & 0xffffu;
-    uint16_t nlen = len ^ 0xffffu;
-    out.write_bits(bfinal, 1);
-    out.write_bits(block_type, 2);
-    out.flush();
-    // TODO: technically need to force little endian
-    out.write(&len, sizeof(len));
-    out.write(&nlen, sizeof(nlen));
-    out.write(&buffer[0], size);
-}
-
-void write_block(const std::vector<int>& lits, const std::vector<int>& dsts, const HuffTrees& tree, BitWriter& out) {
-    assert(lits.size() == dsts.size());
-    for (size_t i = 0; i < lits.size(); ++i) {
-        auto len = lits[i] - LiteralCodes;
-        auto lit = lits[i] <= LiteralCodes ? lits[i] : get_length_code(len);
-        xassert(0 <= lit && lit <= 285, "invalid literal: %d", lit);
-        uint16_t lit_huff_code = tree.codes[lit];
-        int lit_n_bits = tree.codelens[lit];
-        xassert(lit_n_bits > 0, "invalid code length: %u", lit_n_bits);
-        assert(1 <= lit_n_bits && lit_n_bits <= MaxBits);
-        out.write_bits(lit_huff_code, lit_n_bits);
-        if (lit >= 257) {
-            auto len_base = get_length_base(len);
-            auto len_extra = len - len_base;
-            xassert(len_extra >= 0, "len < len_base: %d %d", len, len_base);
-            auto len_extra_bits = get_length_extra_bits(len);
-            if (len_extra_bits > 0) {
-                out.write_bits(static_cast<uint16_t>(len_extra), len_extra_bits);
-            }
-
-            auto dst = dsts[i];
-            xassert(1 <= dst && dst <= 32768, "invalid distance: %d", dst);
-            auto dst_code = get_distance_code(dst);
-            xassert(0 <= dst_code && dst_code <= 29, "invalid distance code: %d", dst_code);
-            uint16_t dst_huff_code = tree.codes[tree.n_lits + dst_code];
-            int dst_n_bits = tree.codelens[tree.n_lits + dst_code];
-            xassert(dst_n_bits > 0, "invalid code length: %u", lit_n_bits);
-            out.write_bits(static_cast<uint16_t>(dst_huff_code), dst_n_bits);
-
-            auto dst_base = get_distance_base(dst);
-            auto dst_extra = dst - dst_base;
-            assert(dst_extra >= 0);
-            auto dst_extra_bits = get_distance_extra_bits(dst);
-            if (dst_extra_bits > 0) {
-                out.write_bits(static_cast<uint16_t>(dst_extra), dst_extra_bits);
-            }
-        }
-    }
+    // a stored block holds at most UINT16_MAX bytes, so larger blocks are
+    // written as several, with only the last one marked final
+    do {
+        uint16_t len = static_cast<uint16_t>(std::min<size_t>(size, UINT16_MAX));
+        uint16_t nlen = len ^ 0xffffu;
+        out.write_bits(len == size ? bfinal : 0, 1);
+        out.write_bits(block_type, 2);
+        out.align();
+        // TODO: technically need to force little endian
+        out.write(&len, sizeof(len));
+        out.write(&nlen, sizeof(nlen));
+        out.write(&buffer[0], len);
+        buffer += len;
+        size -= len;
+    } while (size > 0);
 }
 
 struct DynamicHeader {
@@ -529,18 +672,18 @@ DynamicHeader make_header_tree(const CodeLengths& codelens) {
         extra.insert(extra.end(), cnt, 0);
     }
 
-    auto header_tree = construct_huffman_tree(count_values(codes.data(), codes.size()));
+    uint32_t header_counts[NumHeaderCodeLengths] = {};
+    for (int code : codes) {
+        assert(0 <= code && code < NumHeaderCodeLengths);
+        header_counts[code]++;
+    }
 
     Tree tree;
     tree.codes.assign(NumHeaderCodeLengths, 0xffffu);
     tree.codelens.assign(NumHeaderCodeLengths, 0);
     tree.n_lits = NumHeaderCodeLengths;
     tree.n_dists = 0;  // TEMP TEMP
-    for (auto&& [value, bits] : header_tree) {
-        assert(0 <= value && value < NumHeaderCodeLengths);
-        assert(0 <= bits && bits < MaxBits);
-        tree.codelens[value] = static_cast<uint8_t>(bits);
-    }
+    build_code_lengths(header_counts, NumHeaderCodeLengths, MaxHeaderCodeLength, &tree.codelens[0]);
     init_huffman_tree(&tree.codelens[0], tree.n_lits, &tree.codes[0]);
     return {codes, extra, tree};
 }
@@ -552,7 +695,6 @@ struct HeaderTreeData {
 HeaderTreeData make_header_tree_data(const Tree& tree) {
     constexpr std::array<int, NumHeaderCodeLengths> order = {16, 17, 18, 0, 8,  7, 9,  6, 10, 5,
                                                              11, 4,  12, 3, 13, 2, 14, 1, 15};
-    // TDOO: detect codelen > MaxHeaderCodeLength and bail if so by setting hdr_cost very high
     HeaderTreeData results = {};
     for (size_t i = 0; i < order.size(); ++i) {
         results.codelens[i] = tree.codelens[order[i]];
@@ -566,29 +708,394 @@ HeaderTreeData make_header_tree_data(const Tree& tree) {
 }
 
 constexpr uint32_t update_hash(uint32_t current, uint8_t c) noexcept {
-    constexpr uint32_t mask = (1u << 24) - 1;
-    return ((current << 8) | c) & mask;
+    return ((current << HashShift) ^ c) & HashMask;
 }
 
-int longest_match(const uint8_t* const wnd, const uint8_t* const str, int max_length) {
+// Returns the length of the common prefix of `wnd` and `str`, at most
+// `max_length`. Like zlib, a candidate that can't be longer than
+// `best_length` because it differs at that byte is rejected up front, and
+// the result is then only known to be <= `best_length`. The rest is compared
+// 8 bytes at a time, the first differing byte is the lowest set byte of the
+// xor on a little endian machine and the highest on a big endian one.
+int longest_match(const uint8_t* const wnd, const uint8_t* const str, int max_length, int best_length = 0) {
+    if (best_length >= max_length || wnd[best_length] != str[best_length]) {
+        return 0;
+    }
     int i = 0;
+    for (; i + 8 <= max_length; i += 8) {
+        uint64_t a, b;
+        memcpy(&a, wnd + i, sizeof(a));
+        memcpy(&b, str + i, sizeof(b));
+        if (uint64_t diff = a ^ b) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            return i + (__builtin_clzll(diff) >> 3);
+#else
+            return i + (__builtin_ctzll(diff) >> 3);
+#endif
+        }
+    }
     for (; i < max_length; ++i) {
         if (wnd[i] != str[i]) break;
     }
     return i;
 }
 
+constexpr uint32_t hash3(const uint8_t* p) noexcept {
+    return update_hash(update_hash(update_hash(0, p[0]), p[1]), p[2]);
+}
+
+// A match found by a match finder, or a step of a parse.
+struct Match {
+    uint16_t length;
+    uint16_t distance;
+};
+
+// Most matches a match finder reports for one position: one per length.
+constexpr int MaxMatchesPerPos = MaxMatchLength - MinMatchLength + 1;
+
+// zlib style hash chains: head[h] is the most recent position whose next
+// MinMatchLength bytes hash to h, and prev[pos & WindowMask] is the position
+// before `pos` with the same hash. Positions are offsets into the sliding
+// window, and the chains live for the whole stream so matches can reach back
+// into previous blocks. A chain can only be followed while it stays within
+// WindowSize of the current position, older entries of `prev` get reused.
+//
+// Like BinaryTrees, `find_matches` and `skip` take position `i` of `buf`,
+// which is at offset `base` in the window, and need MinMatchLength bytes
+// there.
+struct HashChains {
+    static constexpr int NoPos = -1;
+
+    HashChains() : head(HashSize, NoPos), prev(WindowSize, NoPos) {}
+
+    void insert(uint32_t h, int pos) noexcept {
+        prev[pos & WindowMask] = head[h];
+        head[h] = pos;
+    }
+
+    // Inserts position `i` and stores the matches of increasing length found
+    // for it in `out`, returning how many. At most `max_depth` candidates are
+    // tried, and the search ends once a match reaches `nice_length`.
+    int find_matches(const uint8_t* buf, int i, int base, int max_length, int nice_length, int max_depth,
+                     Match* out) noexcept {
+        const uint32_t h = hash3(buf + i);
+        nice_length = std::min(nice_length, max_length);
+        int n = 0;
+        int length = MinMatchLength - 1;
+        int iter = 0;
+        for (int cand = head[h]; cand != NoPos && base + i - cand < WindowSize; cand = prev[cand & WindowMask]) {
+            const int pos = cand - base;
+            const int match_length = longest_match(buf + pos, buf + i, max_length, length);
+            if (match_length > length) {
+                length = match_length;
+                out[n++] = {static_cast<uint16_t>(length), static_cast<uint16_t>(i - pos)};
+            }
+            if (length >= nice_length || ++iter >= max_depth) {
+                break;
+            }
+        }
+        insert(h, base + i);
+        return n;
+    }
+
+    // inserts position `i` without looking for matches
+    void skip(const uint8_t* buf, int i, int base, int /*max_length*/, int /*nice_length*/,
+              int /*max_depth*/) noexcept {
+        insert(hash3(buf + i), base + i);
+    }
+
+    // the window moved down by `n` bytes
+    void slide(int n) noexcept {
+        auto update = [n](int& pos) { pos = pos >= n ? pos - n : NoPos; };
+        std::for_each(head.begin(), head.end(), update);
+        std::for_each(prev.begin(), prev.end(), update);
+    }
+
+    std::vector<int> head;
+    std::vector<int> prev;
+};
+
+// Binary tree match finder as in LZMA's bt4 and libdeflate: every hash bucket
+// is a binary search tree of the positions in it, ordered by the strings
+// starting there, with the most recent position at the root. Inserting a
+// position walks down from the root, splitting the tree into the positions
+// whose strings sort before and after it, which become its children. The
+// walk visits the strings sharing the longest prefixes with the new one, so
+// it sees all the best matches of increasing length in one pass, and unlike
+// a hash chain it doesn't degrade on repetitive input.
+//
+// children[2 * (pos & WindowMask)] and [... + 1] are the roots of the lesser
+// and greater subtrees of `pos`. Subtrees further away than WindowSize are
+// cut off as they're reached.
+struct BinaryTrees {
+    static constexpr int NoPos = -1;
+
+    BinaryTrees() : head(HashSize, NoPos), children(2 * WindowSize, NoPos) {}
+
+    int find_matches(const uint8_t* buf, int i, int base, int max_length, int nice_length, int max_depth,
+                     Match* out) noexcept {
+        return advance(buf, i, base, max_length, nice_length, max_depth, out);
+    }
+
+    void skip(const uint8_t* buf, int i, int base, int max_length, int nice_length, int max_depth) noexcept {
+        advance(buf, i, base, max_length, nice_length, max_depth, nullptr);
+    }
+
+    // Inserts position `i`, and if `out` is set stores the matches of
+    // increasing length seen on the way like HashChains::find_matches.
+    int advance(const uint8_t* buf, int i, int base, int max_length, int nice_length, int max_depth,
+                Match* out) noexcept {
+        assert(MinMatchLength <= max_length);
+        const uint32_t h = hash3(buf + i);
+        const uint8_t* const str = buf + i;
+        const int cur = base + i;
+        int node = head[h];
+        head[h] = cur;
+        int* pending_lt = &children[2 * (cur & WindowMask)];
+        int* pending_gt = pending_lt + 1;
+        // the walk ends at nice_length, so bytes past it are never compared
+        nice_length = std::min(nice_length, max_length);
+        int n = 0;
+        int best_length = MinMatchLength - 1;
+        // every string in the lesser (greater) subtree still to be visited
+        // shares at least best_lt (best_gt) bytes with `str`
+        int best_lt = 0;
+        int best_gt = 0;
+        for (int depth = 0; node != NoPos && cur - node < WindowSize && depth < max_depth; ++depth) {
+            const uint8_t* const match = buf + (node - base);
+            const int prefix = std::min(best_lt, best_gt);
+            int length = prefix;
+            if (match[length] == str[length]) {
+                length += 1 + longest_match(match + length + 1, str + length + 1, nice_length - length - 1);
+                // The trees are only ordered on the bytes there were when a
+                // position was inserted, which near the end of a chunk can be
+                // fewer than nice_length. The prefix is checked before a match
+                // is reported so a tree out of order only loses matches.
+                if (length > best_length && memcmp(match, str, prefix) != 0) {
+                    length = longest_match(match, str, nice_length);
+                }
+                if (length > best_length) {
+                    best_length = length;
+                    if (out) {
+                        out[n++] = {static_cast<uint16_t>(length), static_cast<uint16_t>(cur - node)};
+                    }
+                }
+            }
+            int* const node_children = &children[2 * (node & WindowMask)];
+            if (length >= nice_length) {
+                // `str` equals `match` as far as the trees care, so it takes
+                // over its children
+                *pending_lt = node_children[0];
+                *pending_gt = node_children[1];
+                return n;
+            }
+            if (match[length] < str[length]) {
+                *pending_lt = node;
+                pending_lt = node_children + 1;
+                node = *pending_lt;
+                best_lt = length;
+            } else {
+                *pending_gt = node;
+                pending_gt = node_children;
+                node = *pending_gt;
+                best_gt = length;
+            }
+        }
+        *pending_lt = NoPos;
+        *pending_gt = NoPos;
+        return n;
+    }
+
+    // the window moved down by `n` bytes
+    void slide(int n) noexcept {
+        auto update = [n](int& pos) { pos = pos >= n ? pos - n : NoPos; };
+        std::for_each(head.begin(), head.end(), update);
+        std::for_each(children.begin(), children.end(), update);
+    }
+
+    std::vector<int> head;
+    std::vector<int> children;
+};
+
 struct BlockResults {
     CodeLengths codelens;
     size_t hlit;
     size_t hdist;
-    std::vector<int> lits;  // lit <= LiteralCodes --> literal code
-                            // lit  > LiteralCodes --> length value
-    std::vector<int> dsts;
     int64_t fix_cost;
     int64_t dyn_cost;
 };
 
+// Literal/length and distance code counts of a run of symbols, and the number
+// of input bytes they cover.
+struct SymbolStats {
+    uint32_t lits[LitCodes] = {};
+    uint32_t dsts[DistCodes] = {};
+    uint32_t size = 0;
+
+    void add(const SymbolStats& rhs) noexcept {
+        for (int i = 0; i < LitCodes; ++i) {
+            lits[i] += rhs.lits[i];
+        }
+        for (int i = 0; i < DistCodes; ++i) {
+            dsts[i] += rhs.dsts[i];
+        }
+        size += rhs.size;
+    }
+
+    // estimated bits to code the symbols with codes built for them, without
+    // extra bits or the block header
+    double cost() const noexcept { return entropy(lits, LitCodes) + entropy(dsts, DistCodes); }
+
+    static double entropy(const uint32_t* counts, int n) noexcept {
+        double total = 0;
+        for (int i = 0; i < n; ++i) {
+            total += counts[i];
+        }
+        double bits = 0;
+        for (int i = 0; i < n; ++i) {
+            if (counts[i] != 0) {
+                bits += counts[i] * std::log2(total / counts[i]);
+            }
+        }
+        return bits;
+    }
+};
+
+// LZ77 output that hasn't been written out as a block yet, packed LZSS style:
+// bit `i % 8` of flags[i / 8] is set if symbol `i` is a match. A literal takes
+// one byte of `data`, a match four: the length minus MinMatchLength, the
+// distance minus one as 16 bits little endian, and the distance code. The
+// counts of every SplitInterval symbols are kept in `stats` as symbols are
+// added, so blocks can be cut and coded without recounting.
+struct SymbolBuffer {
+    // blocks are cut once MaxBlockSymbols symbols are pending, and a chunk adds
+    // at most one symbol per byte
+    static constexpr size_t Capacity = MaxBlockSymbols + CHUNKSIZE;
+    static_assert(Capacity % SplitInterval == 0 && SplitInterval % 8 == 0);
+
+    SymbolBuffer() : data(4 * Capacity), flags(Capacity / 8, 0), stats(Capacity / SplitInterval) {}
+
+    size_t size() const noexcept { return n_syms; }
+
+    bool is_match(size_t i) const noexcept { return (flags[i / 8] >> (i % 8)) & 1u; }
+
+    void push_lit(uint8_t lit) noexcept {
+        assert(n_syms < Capacity);
+        SymbolStats& seg = stats[n_syms / SplitInterval];
+        seg.lits[lit]++;
+        seg.size++;
+        data[n_bytes++] = lit;
+        n_syms++;
+    }
+
+    void push_match(int dst, int len) noexcept {
+        assert(n_syms < Capacity);
+        assert(MinMatchDistance <= dst && dst <= MaxMatchDistance);
+        assert(MinMatchLength <= len && len <= MaxMatchLength);
+        const int dst_code = get_distance_code(dst);
+        SymbolStats& seg = stats[n_syms / SplitInterval];
+        seg.lits[get_length_code(len)]++;
+        seg.dsts[dst_code]++;
+        seg.size += len;
+        flags[n_syms / 8] |= static_cast<uint8_t>(1u << (n_syms % 8));
+        data[n_bytes + 0] = static_cast<uint8_t>(len - MinMatchLength);
+        data[n_bytes + 1] = static_cast<uint8_t>((dst - 1) & 0xffu);
+        data[n_bytes + 2] = static_cast<uint8_t>((dst - 1) >> 8);
+        data[n_bytes + 3] = static_cast<uint8_t>(dst_code);
+        n_bytes += 4;
+        n_syms++;
+    }
+
+    // counts of the first `n` symbols, which must end at a SplitInterval
+    // boundary or at the end of the buffer
+    SymbolStats count(size_t n) const noexcept {
+        assert(n % SplitInterval == 0 || n == n_syms);
+        SymbolStats result;
+        for (size_t k = 0; k < n; k += SplitInterval) {
+            result.add(stats[k / SplitInterval]);
+        }
+        return result;
+    }
+
+    // drops the first `n` symbols, with the same restriction as `count`
+    void consume(size_t n) noexcept {
+        const size_t n_flags = (n_syms + 7) / 8;
+        if (n == n_syms) {
+            std::fill(flags.begin(), flags.begin() + n_flags, 0);
+            std::fill(stats.begin(), stats.end(), SymbolStats{});
+            n_syms = n_bytes = 0;
+            split_checked = 0;
+            return;
+        }
+        assert(n % SplitInterval == 0);
+        size_t bytes = n;
+        for (size_t i = 0; i < n / 8; ++i) {
+            bytes += 3 * __builtin_popcount(flags[i]);
+        }
+        std::copy(data.begin() + bytes, data.begin() + n_bytes, data.begin());
+        std::copy(flags.begin() + n / 8, flags.begin() + n_flags, flags.begin());
+        std::fill(flags.begin() + (n_flags - n / 8), flags.begin() + n_flags, 0);
+        std::copy(stats.begin() + n / SplitInterval, stats.end(), stats.begin());
+        std::fill(stats.end() - n / SplitInterval, stats.end(), SymbolStats{});
+        n_syms -= n;
+        n_bytes -= bytes;
+        split_checked = 0;
+    }
+
+    std::vector<uint8_t> data;
+    std::vector<uint8_t> flags;
+    std::vector<SymbolStats> stats;
+    size_t n_syms = 0;
+    size_t n_bytes = 0;
+    size_t start = 0;  // offset in the input of the first symbol
+
+    // how far find_block_end got: the first `split_checked` symbols, with
+    // counts `split_stats` and estimated cost `split_cost`, stay in one block
+    size_t split_checked = 0;
+    SymbolStats split_stats;
+    double split_cost = 0;
+};
+
+// Writes the first `n` symbols of `syms` followed by END_BLOCK. Each match
+// goes out in one write_bits call: the length code, its extra bits, the
+// distance code and its extra bits.
+void write_block(const SymbolBuffer& syms, size_t n, const HuffTrees& tree, BitWriter& out) {
+    const uint8_t* p = syms.data.data();
+    for (size_t i = 0; i < n; ++i) {
+        if (!syms.is_match(i)) {
+            const uint8_t lit = *p++;
+            assert(tree.codelens[lit] > 0);
+            out.write_bits(tree.codes[lit], tree.codelens[lit]);
+            continue;
+        }
+        const int len = p[0] + MinMatchLength;
+        const int dst = (p[1] | (p[2] << 8)) + 1;
+        const int dst_code = p[3];
+        p += 4;
+
+        const int lit = get_length_code(len);
+        xassert(257 <= lit && lit <= 285, "invalid literal: %d", lit);
+        const int lit_n_bits = tree.codelens[lit];
+        xassert(1 <= lit_n_bits && lit_n_bits <= MaxBits, "invalid code length: %u", lit_n_bits);
+        xassert(1 <= dst && dst <= 32768, "invalid distance: %d", dst);
+        xassert(dst_code == get_distance_code(dst), "invalid distance code: %d", dst_code);
+        const int dst_n_bits = tree.codelens[tree.n_lits + dst_code];
+        xassert(dst_n_bits > 0, "invalid code length: %u", dst_n_bits);
+        const int len_extra_bits = get_length_extra_bits(len);
+        const int dst_extra_bits = get_distance_extra_bits(dst);
+
+        uint64_t bits = tree.codes[lit];
+        size_t n_bits = lit_n_bits;
+        bits |= static_cast<uint64_t>(len - get_length_base(len)) << n_bits;
+        n_bits += len_extra_bits;
+        bits |= static_cast<uint64_t>(tree.codes[tree.n_lits + dst_code]) << n_bits;
+        n_bits += dst_n_bits;
+        bits |= static_cast<uint64_t>(dst - get_distance_base(dst)) << n_bits;
+        n_bits += dst_extra_bits;
+        out.write_bits(bits, n_bits);
+    }
+    out.write_bits(tree.codes[256], tree.codelens[256]);
+}
 #if 0
 template <class T>
 void analyze_hash_table(const T& ht, const char* buf) {
@@ -622,8 +1129,6 @@ void analyze_hash_table(const T& ht, const char* buf) {
 #define CHECK_HASH(i)                                                                                     \
     {                                                                                                     \
         uint32_t h2 = update_hash(update_hash(update_hash(0, buf[(i) + 0]), buf[(i) + 1]), buf[(i) + 2]); \
-        uint32_t h3 = (buf[(i) + 0] << 16) | (buf[(i) + 1] << 8) | (buf[(i) + 2]);                        \
-        assert(h2 == h3);                                                                                 \
         xassert(h == h2, "%u != %u", h, h2);                                                              \
     }
 #else
@@ -654,90 +1159,71 @@ constexpr Config configs[/*10*/] = {
     /* 7 */ {  8,  32, 128,  256 },  // deflate_slow},
     /* 8 */ { 32, 128, 258, 1024 },  // deflate_slow},
     /* 9 */ { 32, 258, 258, 4096 },  // deflate_slow}}; /* max compression */
-    /* 10 */ { INT_MAX, INT_MAX, INT_MAX, INT_MAX },
+    /* 10 */ { 32, 258, 258, 4096 },  // analyze_block_optimal
 };
 // clang-format on
 
-BlockResults finish_up(std::vector<int>& lits, std::vector<int>& dsts, std::map<int, int>& lit_counts,
-                       std::map<int, int>& dst_counts) {
+BlockResults finish_up(uint32_t (&lit_counts)[LitCodes], uint32_t (&dst_counts)[DistCodes]) {
     // TODO: remove this, shouldn't do dynamic encoding if the input is empty
     // edge case for when input is empty
-    if (lit_counts.empty()) {
+    if (std::all_of(std::begin(lit_counts), std::end(lit_counts), [](uint32_t count) { return count == 0; })) {
         lit_counts[0] = 1;
     }
 
     // must have code for END_BLOCK
-    lits.push_back(256);
-    dsts.push_back(0);
-    lit_counts[lits.back()] = 1;
-
-    assert(lits.size() == dsts.size());
-    // assert(lits.size() == lens.size());
+    lit_counts[256] = 1;
 
-    auto lit_tree = construct_huffman_tree(lit_counts);
-#ifndef NDEBUG
-    for (auto&& [value, codelen] : lit_tree) {
-        xassert(0 <= value && value < 286, "invalid lit value: %d", value);
-        xassert(1 <= codelen && codelen <= MaxBits, "invalid codelen: %d", codelen);
-    }
-#endif
+    uint8_t lit_codelens[LitCodes];
+    build_code_lengths(lit_counts, LitCodes, MaxBits, lit_codelens);
 
     // TODO: try out dst_counts.empty() case so I can test my inflate implementation
     //
     // NOTE: rather than handling case of no length+distance codes, just add 2 codes
     //       because that is what gzip appears to do
-    if (dst_counts.empty()) {
+    if (std::all_of(std::begin(dst_counts), std::end(dst_counts), [](uint32_t count) { return count == 0; })) {
         dst_counts[0] = 1;
         dst_counts[1] = 1;
     }
-    auto dst_tree = construct_huffman_tree(dst_counts);
-#ifndef NDEBUG
-    for (auto&& [value, codelen] : dst_tree) {
-        xassert(0 <= value && value < 32, "invalid dst value: %d", value);
-        xassert(1 <= codelen && codelen <= MaxBits, "invalid codelen: %d", codelen);
-    }
-#endif
-
-    assert(!lit_tree.empty());
-    int max_lit_value = std::max_element(lit_tree.begin(), lit_tree.end(), [](TreeNode a, TreeNode b) {
-                            return a.value < b.value;
-                        })->value;
-    int max_dst_value = std::max_element(dst_tree.begin(), dst_tree.end(), [](TreeNode a, TreeNode b) {
-                            return a.value < b.value;
-                        })->value;
+    uint8_t dst_codelens[DistCodes];
+    build_code_lengths(dst_counts, DistCodes, MaxBits, dst_codelens);
 
     // Ranges:
     // HLIT:  257 - 286
     // HDIST: 1 - 32
-    size_t hlit = std::max(max_lit_value + 1, 257);
-    size_t hdist = std::max(max_dst_value + 1, 1);
+    size_t hlit = LitCodes;
+    while (hlit > 257 && lit_codelens[hlit - 1] == 0) {
+        --hlit;
+    }
+    size_t hdist = DistCodes;
+    while (hdist > 1 && dst_codelens[hdist - 1] == 0) {
+        --hdist;
+    }
     assert(257 <= hlit && hlit <= 286);
     assert(1 <= hdist && hdist <= 32);
 
     CodeLengths codelens(hlit + hdist, 0);
-    assert(codelens.size() == hlit + hdist);
-    for (auto&& [value, codelen] : lit_tree) {
-        xassert(0 <= value && value < codelens.size(), "invalid value: %d", value);
-        xassert(1 <= codelen && codelen <= MaxBits, "invalid codelen: %d", codelen);
-        codelens[value] = codelen;
-    }
-    for (auto&& [value, codelen] : dst_tree) {
-        xassert(hlit <= (value + hlit) && (value + hlit) < codelens.size(), "invalid value: %d", value);
-        xassert(1 <= codelen && codelen <= MaxBits, "invalid codelen: %d", codelen);
-        codelens[value + hlit] = codelen;
-    }
+    std::copy(lit_codelens, lit_codelens + hlit, codelens.begin());
+    std::copy(dst_codelens, dst_codelens + hdist, codelens.begin() + hlit);
     assert(codelens[256] != 0);
 
     int64_t fix_cost = 0;
     int64_t dyn_cost = 0;
-    for (auto&& [lit, count] : lit_counts) {
+    for (int lit = 0; lit < LitCodes; ++lit) {
+        const int64_t count = lit_counts[lit];
+        if (count == 0) {
+            continue;
+        }
         dyn_cost += count * codelens[lit];
         fix_cost += count * fixed_codelens[lit];
         assert(0 <= lit && lit < ARRSIZE(literal_to_extra_bits));
         dyn_cost += count * literal_to_extra_bits[lit];
         fix_cost += count * literal_to_extra_bits[lit];
     }
-    for (auto&& [dst_code, count] : dst_counts) {
+    for (int dst_code = 0; dst_code < DistCodes; ++dst_code) {
+        const int64_t count = dst_counts[dst_code];
+        if (count == 0) {
+            continue;
+        }
         dyn_cost += count * codelens[hlit + dst_code];
         fix_cost += count * fixed_codelens[NumFixedTreeLiterals + dst_code];
         assert(0 <= dst_code && dst_code <= ARRSIZE(distance_code_to_extra_bits));
@@ -745,10 +1231,15 @@ BlockResults finish_up(std::vector<int>& lits, std::vector<int>& dsts, std::map<
         fix_cost += count * distance_code_to_extra_bits[dst_code];
     }
 
-    return {codelens, hlit, hdist, lits, dsts, fix_cost, dyn_cost};
+    return {codelens, hlit, hdist, fix_cost, dyn_cost};
 }
 
-BlockResults analyze_block_lazy(const uint8_t* const buf, size_t size, Config config) {
+// `buf` points at the start of the block in the window, which holds up to
+// WindowSize bytes of history before it, and `base` is its offset into the
+// window. `Finder` is HashChains or BinaryTrees.
+template <typename Finder>
+void analyze_block_lazy(const uint8_t* const buf, size_t size, int base, Config config, Finder& finder,
+                        SymbolBuffer& syms) {
     TRACE("analyze_block_lazy: good_length=%d max_lazy=%d nice_length=%d max_chain=%d", config.good_length,
           config.max_lazy, config.nice_length, config.max_chain);
 
@@ -756,30 +1247,12 @@ BlockResults analyze_block_lazy(const uint8_t* const buf, size_t size, Config co
     const int max_lazy = config.max_lazy;
     const int nice_length = config.nice_length;
     const int max_chain = config.max_chain;
-    std::vector<int> lits;
-    std::vector<int> dsts;
-    std::map<uint32_t, std::vector<int>> ht;
-    uint32_t h = size >= MinMatchLength ? (buf[0] << 8) | buf[1] : 0;
-
-    auto tally_lit = [&](int lit) {
-        lits.push_back(lit);
-        dsts.push_back(0);
-    };
+    Match found[MaxMatchesPerPos];
 
-    auto tally_dst_len = [&](int dst, int len) {
-        lits.push_back(LiteralCodes + len);
-        dsts.push_back(dst);
-    };
-
-    auto update_hash_for_length = [&](int pos, int match_length) {
-        for (int i = 1; i < match_length; ++i) {
-            if (pos + i + 2 >= size) {
-                return;
-            }
-            h = update_hash(h, buf[pos + i + 2]);
-            CHECK_HASH(pos + i);
-            ht[h].push_back(pos + i);
-        }
+    auto tally_lit = [&](uint8_t lit) { syms.push_lit(lit); };
+    auto tally_dst_len = [&](int dst, int len) { syms.push_match(dst, len); };
+    auto max_length_at = [&](int pos) {
+        return static_cast<int>(std::min(static_cast<size_t>(MaxMatchLength), size - pos));
     };
 
     const int max_pos = static_cast<int>(size) - MinMatchLength;
@@ -790,32 +1263,22 @@ BlockResults analyze_block_lazy(const uint8_t* const buf, size_t size, Config co
     while (pos < max_pos) {
         int length = MinMatchLength - 1;
         int distance = -1;  // TEMP TEMP
-        h = update_hash(h, buf[pos + 2]);
-        auto& locs = ht[h];
 
+        // find longest match (within constraints of max_chain and nice_length)
+        // and add position
         if (prev_length < max_lazy) {
-            // find longest match (within constraints of max_chain and nice_length)
             const int max_iters = prev_length >= good_length ? max_chain >> 2 : max_chain;
-            int iter = 0;
-            for (auto rit = locs.rbegin(); rit != locs.rend(); ++rit) {
-                int loc = *rit;
-                const int match_length = longest_match(buf + loc, buf + pos, std::min(static_cast<size_t>(MaxMatchLength), size - pos));
-                if (match_length > length) {
-                    length = match_length;
-                    distance = pos - loc;
-                    xassert(3 <= length && length <= MaxMatchLength, "invalid match length (too long): %d", length);
-                    xassert(0 <= distance && distance <= MaxMatchDistance, "invalid distance (too far): %d", distance);
-                }
-                if (length >= nice_length || ++iter >= max_iters /*!(max_iters-- > 0)*/) {
-                    TRACE("exceeded match or chain length: match_length=%d chain_length=%d", length, iter);
-                    break;
-                }
+            const int n = finder.find_matches(buf, pos, base, max_length_at(pos), nice_length, max_iters, found);
+            if (n > 0) {
+                length = found[n - 1].length;
+                distance = found[n - 1].distance;
+                xassert(3 <= length && length <= MaxMatchLength, "invalid match length (too long): %d", length);
+                xassert(0 <= distance && distance <= MaxMatchDistance, "invalid distance (too far): %d", distance);
             }
+        } else {
+            finder.skip(buf, pos, base, max_length_at(pos), nice_length, max_chain);
         }
 
-        // add position
-        locs.push_back(pos);
-
         const int prev_pos = pos - 1;
         if (prev_length >= MinMatchLength && prev_length >= length) {
             TRACE("using match: len=%d dist=%d str=\"%.*s\" (new_len=%d, new_dst=%d)", prev_length, prev_distance,
@@ -831,16 +1294,14 @@ BlockResults analyze_block_lazy(const uint8_t* const buf, size_t size, Config co
             //         ---------------------------------------------------------------------------------
             //         | 'h'   | 'i'   | 's'   | ' '   | 'i'   | 's'   | ' '   | 'a'   | 't'   | 'e'   |
             //         ---------------------------------------------------------------------------------
-            // hashed: |  x    |  x    |  x    |  x    |  x    |  x    |  x    |  x    |       |       |
+            // added:  |  x    |  x    |  x    |  x    |  x    |  x    |  x    |  x    |       |       |
             //         ---------------------------------------------------------------------------------
             //                                                                                    ^
             //                                                                                    |
-            //                                                                           need to hash to here
+            //                                                                           need to add up to here
 
             for (int i = 2; i < prev_length && (prev_pos + 2 + i) < size; ++i) {
-                h = update_hash(h, buf[prev_pos + 2 + i]);
-                CHECK_HASH(prev_pos + i);
-                ht[h].push_back(prev_pos + i);
+                finder.skip(buf, prev_pos + i, base, max_length_at(prev_pos + i), nice_length, max_chain);
             }
             need_flush = false;
             pos = prev_pos + prev_length;
@@ -874,33 +1335,10 @@ BlockResults analyze_block_lazy(const uint8_t* const buf, size_t size, Config co
     for (; pos < size; ++pos) {
         tally_lit(buf[pos]);
     }
-
-    // TEMP TEMP -- for simplicity count everything at the end
-    std::map<int, int> lit_counts;
-    std::map<int, int> dst_counts;
-    for (int lit : lits) {
-        if (lit <= LiteralCodes) {
-            lit_counts[lit]++;
-        } else {
-            lit_counts[get_length_code(lit - LiteralCodes)]++;
-        }
-    }
-    for (int dst : dsts) {
-        if (dst != 0) {
-            dst_counts[get_distance_code(dst)]++;
-        }
-    }
-
-    TRACE("--- DST CODE COUNTS")
-    for (auto&& [dst, cnt] : dst_counts) {
-        TRACE("%d: %d", dst, cnt);
-    }
-    TRACE("--- END DST CODE COUNTS")
-
-    return finish_up(lits, dsts, lit_counts, dst_counts);
 }
 
-BlockResults analyze_block(const uint8_t* const buf, size_t size, Config config) {
+void analyze_block(const uint8_t* const buf, size_t size, int base, Config config, HashChains& chains,
+                   SymbolBuffer& syms) {
     // TODO: add fast path for analyzing very small blocks. no point in even trying
     //       dynamic encoding in that case, and potentially gives optimization ability
     //       to know that there are at least N bytes of input
@@ -908,42 +1346,26 @@ BlockResults analyze_block(const uint8_t* const buf, size_t size, Config config)
     TRACE("analyze_block: good_length=%d max_lazy=%d nice_length=%d max_chain=%d", config.good_length, config.max_lazy,
           config.nice_length, config.max_chain);
 
-    std::vector<int> lits;
-    std::vector<int> dsts;
-    std::map<int, int> lit_counts;
-    std::map<int, int> dst_counts;
-    std::map<uint32_t, std::vector<int>> ht;
     const int nice_length = config.nice_length;
     const int max_chain = config.max_chain;
-    uint32_t h = size >= 2 ? ((buf[0] << 8) | (buf[1] << 0)) : 0;
+    uint32_t h = size >= 2 ? update_hash(update_hash(0, buf[0]), buf[1]) : 0;
 
-    auto tally_lit = [&](int lit) {
-        assert(0 <= lit && lit <= LiteralCodes);
-        lits.push_back(lit);
-        dsts.push_back(0);
-        lit_counts[lit]++;
-    };
-    auto tally_dst_len = [&](int dst, int len) {
-        assert(MinMatchDistance <= dst && dst <= MaxMatchDistance);
-        assert(MinMatchLength <= len && len <= MaxMatchLength);
-        lits.push_back(LiteralCodes + len);
-        dsts.push_back(dst);
-        lit_counts[get_length_code(len)]++;
-        dst_counts[get_distance_code(dst)]++;
-    };
+    auto tally_lit = [&](uint8_t lit) { syms.push_lit(lit); };
+    auto tally_dst_len = [&](int dst, int len) { syms.push_match(dst, len); };
 
     size_t i = 0;
     while (i + 3 < size) {
         xassert(i + 2 < size, "i=%zu size=%zu", i, size);
         h = update_hash(h, buf[i + 2]);
         CHECK_HASH(i);
-        auto& locs = ht[h];
         int length = 2;
         int distance = 0;
         int iter = 0;
-        for (auto rit = locs.rbegin(); rit != locs.rend(); ++rit) {
-            int pos = *rit;
-            int match_length = longest_match(buf + pos, buf + i, std::min(static_cast<size_t>(MaxMatchLength), size - i));
+        for (int cand = chains.head[h]; cand != HashChains::NoPos && base + static_cast<int>(i) - cand < WindowSize;
+             cand = chains.prev[cand & WindowMask]) {
+            int pos = cand - base;
+            const int max_length = static_cast<int>(std::min(static_cast<size_t>(MaxMatchLength), size - i));
+            int match_length = longest_match(buf + pos, buf + i, max_length, length);
             if (match_length > length) {
                 length = match_length;
                 distance = i - pos;
@@ -955,7 +1377,7 @@ BlockResults analyze_block(const uint8_t* const buf, size_t size, Config config)
                 break;
             }
         }
-        locs.push_back(i);
+        chains.insert(h, base + static_cast<int>(i));
         if (length >= 3) {
             TRACE("using match: len=%d dist=%d str=\"%.*s\"", length, distance, length, &buf[i - distance]);
             for (int j = 1; j < length; ++j) {
@@ -964,7 +1386,7 @@ BlockResults analyze_block(const uint8_t* const buf, size_t size, Config config)
                 }
                 h = update_hash(h, buf[i + j + 2]);
                 CHECK_HASH(i + j);
-                ht[h].push_back(i + j);
+                chains.insert(h, base + static_cast<int>(i + j));
             }
             i += length;
             tally_dst_len(distance, length);
@@ -976,16 +1398,311 @@ BlockResults analyze_block(const uint8_t* const buf, size_t size, Config config)
     for (; i < size; ++i) {
         tally_lit(buf[i]);
     }
+}
 
-    TRACE("--- DST CODE COUNTS")
-    for (auto&& [dst, cnt] : dst_counts) {
-        TRACE("%d: %d", dst, cnt);
+constexpr uint32_t hash4(const uint8_t* p) noexcept {
+    return ((p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24)) * 0x9e3779b1u) >>
+           (32 - HashBits);
+}
+
+// Speed first greedy matcher for levels 1-3, modeled on zlib's deflate_fast.
+// Positions are hashed on 4 bytes, only up to max_chain candidates are tried,
+// and the positions inside a match are only inserted if it is no longer than
+// max_lazy (zlib's max_insert_length). After SkipStart literals in a row the
+// scan moves on by more than one byte at a time, so incompressible input is
+// passed over quickly; the bytes skipped that way become literals and aren't
+// inserted either.
+void analyze_block_greedy(const uint8_t* const buf, size_t size, int base, Config config, HashChains& chains,
+                          SymbolBuffer& syms) {
+    constexpr int SkipStart = 32;
+    constexpr int SkipShift = 4;
+
+    TRACE("analyze_block_greedy: max_lazy=%d nice_length=%d max_chain=%d", config.max_lazy, config.nice_length,
+          config.max_chain);
+
+    const int max_insert = config.max_lazy;
+    const int nice_length = config.nice_length;
+    const int max_chain = config.max_chain;
+    int misses = 0;
+    size_t i = 0;
+    while (i + 4 <= size) {
+        const uint32_t h = hash4(buf + i);
+        const int max_length = static_cast<int>(std::min(static_cast<size_t>(MaxMatchLength), size - i));
+        int length = MinMatchLength - 1;
+        int distance = 0;
+        int iter = 0;
+        for (int cand = chains.head[h]; cand != HashChains::NoPos && base + static_cast<int>(i) - cand < WindowSize;
+             cand = chains.prev[cand & WindowMask]) {
+            const int pos = cand - base;
+            const int match_length = longest_match(buf + pos, buf + i, max_length, length);
+            if (match_length > length) {
+                length = match_length;
+                distance = static_cast<int>(i) - pos;
+            }
+            if (length >= nice_length || ++iter >= max_chain) {
+                break;
+            }
+        }
+        chains.insert(h, base + static_cast<int>(i));
+
+        if (length >= MinMatchLength) {
+            TRACE("using match: len=%d dist=%d", length, distance);
+            syms.push_match(distance, length);
+            if (length <= max_insert) {
+                for (size_t j = i + 1; j < i + length && j + 4 <= size; ++j) {
+                    chains.insert(hash4(buf + j), base + static_cast<int>(j));
+                }
+            }
+            i += length;
+            misses = 0;
+        } else {
+            const size_t step = misses < SkipStart ? 1 : 1 + ((misses - SkipStart) >> SkipShift);
+            const size_t end = std::min(i + step, size);
+            for (; i < end; ++i) {
+                syms.push_lit(buf[i]);
+            }
+            misses++;
+        }
+    }
+    for (; i < size; ++i) {
+        syms.push_lit(buf[i]);
+    }
+}
+
+// Cost in bits of every literal/length and distance code, as used by the
+// optimal parser.
+struct SymbolCosts {
+    uint32_t lits[LitCodes];
+    uint32_t dsts[DistCodes];
+
+    static SymbolCosts fixed() noexcept {
+        SymbolCosts costs;
+        std::copy(fixed_codelens, fixed_codelens + LitCodes, costs.lits);
+        std::copy(fixed_codelens + NumFixedTreeLiterals, fixed_codelens + NumFixedTreeLiterals + DistCodes,
+                  costs.dsts);
+        return costs;
+    }
+
+    // the code lengths a block with these counts would get, codes that aren't
+    // used are assumed to be as long as codes get
+    static SymbolCosts from_counts(uint32_t (&lit_counts)[LitCodes], uint32_t (&dst_counts)[DistCodes]) noexcept {
+        SymbolCosts costs;
+        uint8_t lit_codelens[LitCodes];
+        uint8_t dst_codelens[DistCodes];
+        build_code_lengths(lit_counts, LitCodes, MaxBits, lit_codelens);
+        build_code_lengths(dst_counts, DistCodes, MaxBits, dst_codelens);
+        for (int i = 0; i < LitCodes; ++i) {
+            costs.lits[i] = lit_codelens[i] != 0 ? lit_codelens[i] : MaxBits;
+        }
+        for (int i = 0; i < DistCodes; ++i) {
+            costs.dsts[i] = dst_codelens[i] != 0 ? dst_codelens[i] : MaxBits;
+        }
+        return costs;
+    }
+};
+
+// Near optimal parser for level 10, in the style of zopfli and libdeflate.
+// All matches of increasing length are collected for every position first,
+// then the cheapest way through the chunk is found as a shortest path where
+// each position can be left by a literal or by a match of any length up to
+// each candidate's. The first pass prices codes as in the fixed huffman
+// tree, later passes with the code lengths the previous path would get. A
+// step of the path is a Match of length 1 for a literal.
+template <typename Finder>
+void analyze_block_optimal(const uint8_t* const buf, size_t size, int base, Config config, Finder& finder,
+                           SymbolBuffer& syms) {
+    constexpr int OptimalPasses = 4;
+
+    TRACE("analyze_block_optimal: nice_length=%d max_chain=%d", config.nice_length, config.max_chain);
+
+    const int nice_length = config.nice_length;
+    const int max_chain = config.max_chain;
+
+    // matches[first[i]..first[i + 1]) are the candidates at position i, by
+    // increasing length. Inside a match of nice_length or more the finder
+    // isn't searched, see below.
+    std::vector<Match> matches;
+    std::vector<uint32_t> first(size + 1);
+    Match found[MaxMatchesPerPos];
+    int run_distance = 0;  // of the match of nice_length or more we are in, if any
+    for (size_t i = 0; i < size; ++i) {
+        first[i] = static_cast<uint32_t>(matches.size());
+        if (i + MinMatchLength > size) {
+            continue;
+        }
+        const int max_length = static_cast<int>(std::min(static_cast<size_t>(MaxMatchLength), size - i));
+        const int good_enough = std::min(nice_length, max_length);
+        if (run_distance != 0) {
+            // inside such a match the candidates are those of the previous
+            // position one byte shorter, with the longest one extended as far
+            // as it goes. Once that is shorter than nice_length the finder is
+            // searched again.
+            const uint32_t prev_first = first[i - 1];
+            const uint32_t prev_last = first[i];
+            for (uint32_t m = prev_first; m < prev_last; ++m) {
+                if (matches[m].length > MinMatchLength) {
+                    matches.push_back({static_cast<uint16_t>(std::min<int>(matches[m].length - 1, max_length)),
+                                       matches[m].distance});
+                }
+            }
+            const int length = longest_match(buf + i - run_distance, buf + i, max_length);
+            if (matches.size() > first[i] && matches.back().distance == run_distance) {
+                matches.back().length = static_cast<uint16_t>(length);
+            }
+            if (length < good_enough) {
+                run_distance = 0;
+            }
+            finder.skip(buf, static_cast<int>(i), base, max_length, nice_length, max_chain);
+        } else {
+            const int n =
+                finder.find_matches(buf, static_cast<int>(i), base, max_length, nice_length, max_chain, found);
+            matches.insert(matches.end(), found, found + n);
+            if (n > 0 && matches.back().length >= good_enough) {
+                run_distance = matches.back().distance;
+            }
+        }
+    }
+    first[size] = static_cast<uint32_t>(matches.size());
+
+    std::vector<uint32_t> cost(size + 1);
+    std::vector<Match> how(size + 1);  // the last step of the cheapest path to each position
+    std::vector<Match> path;
+    SymbolCosts costs = SymbolCosts::fixed();
+    for (int pass = 0; pass < OptimalPasses; ++pass) {
+        uint32_t length_costs[MaxMatchLength + 1];
+        for (int len = MinMatchLength; len <= MaxMatchLength; ++len) {
+            length_costs[len] = costs.lits[get_length_code(len)] + get_length_extra_bits(len);
+        }
+
+        std::fill(cost.begin(), cost.end(), UINT32_MAX);
+        cost[0] = 0;
+        for (size_t i = 0; i < size; ++i) {
+            const uint32_t here = cost[i];
+            const uint32_t lit_cost = here + costs.lits[buf[i]];
+            if (lit_cost < cost[i + 1]) {
+                cost[i + 1] = lit_cost;
+                how[i + 1] = {1, 0};
+            }
+            int len = MinMatchLength;
+            for (uint32_t m = first[i]; m < first[i + 1]; ++m) {
+                const int dst = matches[m].distance;
+                const uint32_t dst_cost = here + costs.dsts[get_distance_code(dst)] + get_distance_extra_bits(dst);
+                for (; len <= matches[m].length; ++len) {
+                    const uint32_t match_cost = dst_cost + length_costs[len];
+                    if (match_cost < cost[i + len]) {
+                        cost[i + len] = match_cost;
+                        how[i + len] = {static_cast<uint16_t>(len), static_cast<uint16_t>(dst)};
+                    }
+                }
+            }
+        }
+
+        path.clear();
+        for (size_t i = size; i > 0; i -= how[i].length) {
+            path.push_back(how[i]);
+        }
+        TRACE("optimal pass %d: %u bits", pass, cost[size]);
+        if (pass + 1 == OptimalPasses) {
+            break;
+        }
+
+        uint32_t lit_counts[LitCodes] = {};
+        uint32_t dst_counts[DistCodes] = {};
+        lit_counts[256] = 1;
+        size_t end = size;
+        for (const Match& step : path) {
+            end -= step.length;
+            if (step.length == 1) {
+                lit_counts[buf[end]]++;
+            } else {
+                lit_counts[get_length_code(step.length)]++;
+                dst_counts[get_distance_code(step.distance)]++;
+            }
+        }
+        costs = SymbolCosts::from_counts(lit_counts, dst_counts);
     }
-    TRACE("--- END DST CODE COUNTS")
 
-    return finish_up(lits, dsts, lit_counts, dst_counts);
+    size_t pos = 0;
+    for (auto it = path.rbegin(); it != path.rend(); ++it) {
+        if (it->length == 1) {
+            syms.push_lit(buf[pos]);
+        } else {
+            syms.push_match(it->distance, it->length);
+        }
+        pos += it->length;
+    }
+    assert(pos == size);
 }
 
+// The parser and match finder a compression level uses, see `main`.
+struct Analyzer {
+    Analyzer(int compression_level, bool use_fast) : config{configs[compression_level]} {
+        const int max_compression = ARRSIZE(configs) - 1;
+        // The lazy parser at levels 8 and 9 and the optimal parser find their
+        // matches with binary trees, which stay fast on the long searches they
+        // do. Everything else uses hash chains, the greedy parsers mostly insert
+        // positions, which binary trees make a lot more expensive.
+        analyzer = use_fast ? analyze_block : analyze_block_lazy<HashChains>;
+        tree_analyzer = analyze_block_lazy<BinaryTrees>;
+        if (use_fast && 1 <= compression_level && compression_level <= 3) {
+            analyzer = analyze_block_greedy;
+            greedy = true;
+        } else if (compression_level == max_compression) {
+            tree_analyzer = analyze_block_optimal<BinaryTrees>;
+        }
+        if ((!use_fast && compression_level >= 8) || compression_level == max_compression) {
+            trees = std::make_unique<BinaryTrees>();
+        }
+    }
+
+    // `buf` points at `size` bytes at offset `base` of the window, with up to
+    // WindowSize bytes of history before them
+    void analyze(const uint8_t* buf, size_t size, int base, SymbolBuffer& syms) {
+        if (trees) {
+            tree_analyzer(buf, size, base, config, *trees, syms);
+        } else {
+            analyzer(buf, size, base, config, chains, syms);
+        }
+    }
+
+    // Adds the first `n` positions of `buf`, which holds `size` bytes at
+    // offset `base` of the window, to the match finder without looking for
+    // matches, so they can be matched against like zlib's preset dictionary.
+    void prime(const uint8_t* buf, size_t n, size_t size, int base) {
+        for (size_t i = 0; i < n; ++i) {
+            const int max_length = static_cast<int>(std::min(static_cast<size_t>(MaxMatchLength), size - i));
+            if (greedy) {
+                if (i + 4 > size) {
+                    break;
+                }
+                chains.insert(hash4(buf + i), base + static_cast<int>(i));
+            } else if (i + MinMatchLength > size) {
+                break;
+            } else if (trees) {
+                trees->skip(buf, static_cast<int>(i), base, max_length, config.nice_length, config.max_chain);
+            } else {
+                chains.skip(buf, static_cast<int>(i), base, max_length, config.nice_length, config.max_chain);
+            }
+        }
+    }
+
+    // the window moved down by `n` bytes
+    void slide(int n) noexcept {
+        if (trees) {
+            trees->slide(n);
+        } else {
+            chains.slide(n);
+        }
+    }
+
+    const Config config;
+    void (*analyzer)(const uint8_t*, size_t, int, Config, HashChains&, SymbolBuffer&) = nullptr;
+    void (*tree_analyzer)(const uint8_t*, size_t, int, Config, BinaryTrees&, SymbolBuffer&) = nullptr;
+    bool greedy = false;
+    HashChains chains;
+    std::unique_ptr<BinaryTrees> trees;
+};
+
 int64_t calculate_header_cost(const Tree& htree, const std::vector<int>& hcodes, int n_hcodelens) {
     int64_t cost = 5 + 5 + 4;
     cost += 3 * n_hcodelens;
@@ -996,18 +1713,27 @@ int64_t calculate_header_cost(const Tree& htree, const std::vector<int>& hcodes,
     return cost;
 }
 
-void compress_block(const uint8_t* const buf, size_t size, uint8_t bfinal, bool use_fast, int compression_level, BitWriter& out, int block_number) {
-    auto* analyzer = use_fast ? analyze_block : analyze_block_lazy;
-    auto& config = configs[compression_level];
-    // analyze_block(buf, size, config);
-    auto&& [codelens, hlit, hdist, lits, dsts, fix_cost, dyn_cost] = analyzer(buf, size, config);
+// Writes the first `n` symbols of `syms`, whose counts are `counts`, as one
+// block. `buf` holds the `counts.size` bytes of input they cover so the block
+// can be stored instead, or is nullptr if they are no longer available.
+void compress_block(const SymbolBuffer& syms, size_t n, const SymbolStats& counts, const uint8_t* const buf,
+                    uint8_t bfinal, BitWriter& out, int block_number) {
+    const size_t size = counts.size;
+    SymbolStats freqs = counts;
+
+    TRACE("--- DST CODE COUNTS")
+    for (int dst = 0; dst < DistCodes; ++dst) {
+        TRACE("%d: %u", dst, freqs.dsts[dst]);
+    }
+    TRACE("--- END DST CODE COUNTS")
+
+    auto&& [codelens, hlit, hdist, fix_cost, dyn_cost] = finish_up(freqs.lits, freqs.dsts);
     auto&& [hcodes, hextra, htree] = make_header_tree(codelens);
     auto&& [header_data, hclen] = make_header_tree_data(htree);
     auto hdr_cost = calculate_header_cost(htree, hcodes, hclen);
-    // TODO(peter): better way to detect this?
-    bool is_possible = std::all_of(htree.codelens.begin(), htree.codelens.end(),
-                                   [](uint8_t codelen) { return codelen <= MaxHeaderCodeLength; });
-    int64_t nc_cost = 5 + 16 + 16 + 8 * size;       // "Header Block flush" + LEN + NLEN + `LEN` bytes
+    // "Header Block flush" + LEN + NLEN + `LEN` bytes, for each stored block needed
+    const int64_t n_stored = std::max<int64_t>(1, (size + UINT16_MAX - 1) / UINT16_MAX);
+    int64_t nc_cost = buf ? n_stored * (5 + 16 + 16) + 8 * size : INT64_MAX - 3;
     const char* compress_type = nullptr;            // TEMP TEMP
     uint64_t before = 0, after = 0, hdr_after = 0;  // TEMP TEMP
 
@@ -1016,7 +1742,7 @@ void compress_block(const uint8_t* const buf, size_t size, uint8_t bfinal, bool
     fix_cost += 3;
     nc_cost += 3;
 
-    auto tot_dyn_cost = is_possible ? hdr_cost + dyn_cost : INT64_MAX;
+    auto tot_dyn_cost = hdr_cost + dyn_cost;
 
     if (nc_cost < fix_cost && nc_cost < tot_dyn_cost) {
         before = hdr_after = out.total_written;
@@ -1024,7 +1750,7 @@ void compress_block(const uint8_t* const buf, size_t size, uint8_t bfinal, bool
         after = out.total_written;
         compress_type = "No Compression";
     } else if (tot_dyn_cost < fix_cost) {
-        static uint16_t codes[MaxNumCodes + 1];  // TODO: figure out where to put this data
+        uint16_t codes[MaxNumCodes + 1];
         init_huffman_tree(&codelens[0], hlit, &codes[0]);
         init_huffman_tree(&codelens[hlit], hdist, &codes[hlit]);
         xassert(257 <= hlit && hlit <= 286, "hlit = %zu", hlit);
@@ -1075,7 +1801,7 @@ void compress_block(const uint8_t* const buf, size_t size, uint8_t bfinal, bool
         trees.n_lits = hlit;
         trees.n_dists = hdist;
         hdr_after = out.total_written;
-        write_block(lits, dsts, trees, out);
+        write_block(syms, n, trees, out);
         after = out.total_written;
         compress_type = "Dynamic Huffman";
     } else {
@@ -1083,7 +1809,7 @@ void compress_block(const uint8_t* const buf, size_t size, uint8_t bfinal, bool
         uint8_t block_type = static_cast<uint8_t>(BType::FIXED_HUFFMAN);
         out.write_bits(bfinal, 1);
         out.write_bits(block_type, 2);
-        write_block(lits, dsts, fixed_tree, out);
+        write_block(syms, n, fixed_tree, out);
         after = out.total_written;
         compress_type = "Fixed Huffman";
     }
@@ -1094,12 +1820,299 @@ void compress_block(const uint8_t* const buf, size_t size, uint8_t bfinal, bool
           after - before, bfinal_desc);
 }
 
+// Returns the number of symbols at the front of `syms` that should make up the
+// next block, or 0 if that isn't known until more symbols arrive. Once `final`
+// is set, the remaining symbols end the last block.
+size_t find_block_end(SymbolBuffer& syms, bool final) {
+    const size_t n = syms.size();
+    const size_t limit = std::min(n, MaxBlockSymbols);
+    for (size_t k = syms.split_checked; k + SplitInterval <= limit; k += SplitInterval) {
+        const SymbolStats& next = syms.stats[k / SplitInterval];
+        const double next_cost = next.cost();
+        if (k > 0) {
+            SymbolStats merged = syms.split_stats;
+            merged.add(next);
+            const double merged_cost = merged.cost();
+            if (merged_cost - syms.split_cost - next_cost > SplitMinSavings) {
+                TRACE("splitting block at symbol %zu", k);
+                return k;
+            }
+            syms.split_stats = merged;
+            syms.split_cost = merged_cost;
+        } else {
+            syms.split_stats = next;
+            syms.split_cost = next_cost;
+        }
+        syms.split_checked = k + SplitInterval;
+    }
+    if (n >= MaxBlockSymbols) {
+        return MaxBlockSymbols;
+    }
+    return final ? n : 0;
+}
+
+// Writes out every block at the front of `syms` whose end is known, or all of
+// them as `flush` asks, always at least one block for Flush::FINISH. `window`
+// holds the input from offset `window_start` on, which is used for blocks that
+// are better off stored.
+void emit_blocks(SymbolBuffer& syms, const uint8_t* window, size_t window_start, Flush flush, BitWriter& out,
+                 int& block_number) {
+    const bool final = flush != Flush::NONE;
+    for (;;) {
+        if (flush == Flush::SYNC && syms.size() == 0) {
+            blkwrite_no_compression(nullptr, 0, 0, out);
+            return;
+        }
+        const size_t end = find_block_end(syms, final);
+        if (end == 0 && !final) {
+            return;
+        }
+        const uint8_t bfinal = flush == Flush::FINISH && end == syms.size();
+        const SymbolStats counts = syms.count(end);
+        const uint8_t* buf = syms.start >= window_start ? &window[syms.start - window_start] : nullptr;
+        compress_block(syms, end, counts, buf, bfinal, out, block_number++);
+        syms.consume(end);
+        syms.start += counts.size;
+        if (bfinal) {
+            return;
+        }
+    }
+}
+
+// Compresses the rest of `fp` into `out` as one deflate stream, updating the
+// `crc` and `isize` of the gzip trailer. Reading and writing run on threads
+// of their own, connected to this one by BufferPipes, so the I/O and the crc
+// overlap with the compression.
+void compress_serial(FILE* fp, FILE* out, int compression_level, bool use_fast, uint32_t& crc, uint32_t& isize) {
+    BufferPipe input{CHUNKSIZE};
+    BufferPipe output{BitWriter::PipeBufferSize};
+    std::thread reader([&] {
+        for (;;) {
+            BufferPipe::Buffer buffer = input.get_empty();
+            buffer.size = fread(buffer.data, 1, input.capacity, fp);
+            if (ferror(fp)) {
+                panic("error reading from file");
+            }
+            crc = calc_crc32(crc, buffer.data, buffer.size);
+            isize += buffer.size;
+            input.put_filled(buffer);
+            if (buffer.size == 0) {
+                return;
+            }
+        }
+    });
+    std::thread writer_thread([&] {
+        for (;;) {
+            BufferPipe::Buffer buffer = output.get_filled();
+            if (buffer.size == 0) {
+                return;
+            }
+            xwrite(buffer.data, 1, buffer.size, out);
+            output.put_empty(buffer);
+        }
+    });
+
+    BitWriter writer{output};
+    Analyzer analyzer{compression_level, use_fast};
+    int block_number = 0;
+    SymbolBuffer syms;
+    // The window holds up to WindowSize bytes of history followed by the chunk
+    // being read. Once the next chunk wouldn't fit, the last WindowSize bytes
+    // are slid down to the start, like zlib's fill_window. Blocks are cut from
+    // the symbols of as many chunks as it takes, see `find_block_end`.
+    static uint8_t window[2 * WindowSize];
+    size_t window_start = 0;  // offset in the input of window[0]
+    size_t start = 0;         // offset of the current chunk in the window
+    size_t size = 0;          // bytes of the current chunk read so far
+    for (BufferPipe::Buffer buffer; (buffer = input.get_filled()).size > 0; input.put_empty(buffer)) {
+        for (size_t pos = 0; pos < buffer.size;) {
+            const size_t n = std::min(buffer.size - pos, CHUNKSIZE - size);
+            memcpy(&window[start + size], buffer.data + pos, n);
+            pos += n;
+            size += n;
+            if (size == CHUNKSIZE) {
+                analyzer.analyze(&window[start], CHUNKSIZE, static_cast<int>(start), syms);
+                emit_blocks(syms, window, window_start, Flush::NONE, writer, block_number);
+                start += CHUNKSIZE;
+                size = 0;
+                if (start + CHUNKSIZE > sizeof(window)) {
+                    const size_t n_slide = start - WindowSize;
+                    memmove(&window[0], &window[n_slide], WindowSize);
+                    analyzer.slide(static_cast<int>(n_slide));
+                    window_start += n_slide;
+                    start = WindowSize;
+                }
+            }
+        }
+    }
+    reader.join();
+
+    // If the input file is empty, do need to write at least 1 block, which can
+    // contain no data.
+    assert(size < CHUNKSIZE);
+    if (size > 0) {
+        analyzer.analyze(&window[start], size, static_cast<int>(start), syms);
+    }
+    emit_blocks(syms, window, window_start, Flush::FINISH, writer, block_number);
+    writer.flush();
+    BufferPipe::Buffer end = output.get_empty();
+    end.size = 0;
+    output.put_filled(end);
+    writer_thread.join();
+}
+
+// Runs tasks on a fixed set of threads, oldest first.
+struct WorkQueue {
+    explicit WorkQueue(int n_threads) {
+        for (int i = 0; i < n_threads; ++i) {
+            threads.emplace_back([this] { run(); });
+        }
+    }
+
+    ~WorkQueue() {
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            done = true;
+        }
+        cv.notify_all();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    void push(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            tasks.push_back(std::move(task));
+        }
+        cv.notify_one();
+    }
+
+    void run() {
+        for (;;) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock{mutex};
+                cv.wait(lock, [this] { return done || !tasks.empty(); });
+                if (tasks.empty()) {
+                    return;
+                }
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::function<void()>> tasks;
+    bool done = false;
+    std::vector<std::thread> threads;
+};
+
+// A chunk of the input for `compress_parallel`, with the input before it as
+// its dictionary.
+struct ParallelJob {
+    std::vector<uint8_t> input;  // `dict_size` bytes of history, then the chunk
+    size_t dict_size;
+    size_t offset;  // of the chunk in the input
+    bool last;
+};
+
+struct ParallelResult {
+    std::vector<uint8_t> output;
+    uint32_t crc;
+    size_t size;
+};
+
+// Compresses the chunk of `job` on its own, the output is a run of whole bytes
+// that ends in a sync marker or, for the last chunk, a final block.
+ParallelResult compress_chunk(const ParallelJob& job, int compression_level, bool use_fast) {
+    ParallelResult result;
+    const uint8_t* const buf = job.input.data();
+    const size_t size = job.input.size();
+    result.size = size - job.dict_size;
+    result.crc = calc_crc32(0, buf + job.dict_size, result.size);
+
+    Analyzer analyzer{compression_level, use_fast};
+    analyzer.prime(buf, job.dict_size, size, 0);
+    SymbolBuffer syms;
+    syms.start = job.offset;
+    const size_t window_start = job.offset - job.dict_size;
+    BitWriter writer{result.output};
+    int block_number = 0;
+    for (size_t pos = job.dict_size; pos < size; pos += CHUNKSIZE) {
+        analyzer.analyze(buf + pos, std::min(CHUNKSIZE, size - pos), static_cast<int>(pos), syms);
+        emit_blocks(syms, buf, window_start, Flush::NONE, writer, block_number);
+    }
+    emit_blocks(syms, buf, window_start, job.last ? Flush::FINISH : Flush::SYNC, writer, block_number);
+    writer.flush();
+    return result;
+}
+
+// Like `compress_serial`, but splits the input into ParallelChunkSize chunks
+// that are compressed on `n_threads` threads, as pigz does. Each chunk uses
+// the last WindowSize bytes before it as a preset dictionary, so matches can
+// still reach back across chunks, and ends on a byte boundary with a sync
+// marker so the outputs can simply be concatenated in order. The crc of the
+// chunks is merged with crc32_combine. Up to 2 chunks per thread are in
+// flight, that bounds the memory used.
+void compress_parallel(FILE* fp, int compression_level, bool use_fast, int n_threads, BitWriter& writer,
+                       uint32_t& crc, uint32_t& isize) {
+    WorkQueue queue{n_threads};
+    std::deque<std::future<ParallelResult>> pending;
+    auto write_oldest = [&]() {
+        ParallelResult result = pending.front().get();
+        pending.pop_front();
+        writer.write(result.output.data(), result.output.size());
+        crc = crc32_combine(crc, result.crc, result.size);
+        isize += static_cast<uint32_t>(result.size);
+    };
+
+    // a chunk is read ahead to tell whether the current one is the last, an
+    // empty input still gets one (empty) chunk
+    std::vector<uint8_t> dict;
+    std::vector<uint8_t> next(ParallelChunkSize);
+    size_t n_next = fread(next.data(), 1, next.size(), fp);
+    size_t offset = 0;
+    for (bool last = false; !last;) {
+        ParallelJob job;
+        job.input.reserve(dict.size() + n_next);
+        job.input.assign(dict.begin(), dict.end());
+        job.input.insert(job.input.end(), next.begin(), next.begin() + n_next);
+        job.dict_size = dict.size();
+        job.offset = offset;
+        offset += n_next;
+        n_next = fread(next.data(), 1, next.size(), fp);
+        if (ferror(fp)) {
+            panic("error reading from file");
+        }
+        job.last = last = n_next == 0;
+        dict.assign(job.input.end() - std::min(job.input.size(), static_cast<size_t>(WindowSize)), job.input.end());
+
+        auto task = std::make_shared<std::packaged_task<ParallelResult()>>(
+            [job = std::move(job), compression_level, use_fast] {
+                return compress_chunk(job, compression_level, use_fast);
+            });
+        pending.push_back(task->get_future());
+        queue.push([task] { (*task)(); });
+        if (pending.size() >= 2 * static_cast<size_t>(n_threads)) {
+            write_oldest();
+        }
+    }
+    while (!pending.empty()) {
+        write_oldest();
+    }
+}
+
 int main(int argc, char** argv) {
     cxxopts::Options options("compress", "compress files using the LZ77 compression algorithm into the gzip format");
     options.add_options()
         ("f,fast", "use the non-lazy implementation")
         ("s,slow", "use the lazy implementation")
         ("l,level", "the level of compression to use", cxxopts::value<int>()->default_value("6"))
+        ("p,processes", "compress on this many threads", cxxopts::value<int>()->default_value("1"))
         ("input", "input filename", cxxopts::value<std::string>(), "FILE")
         ("output", "output filename", cxxopts::value<std::string>(), "OUTPUT")
         ("h,help", "Print usage")
@@ -1131,11 +2144,13 @@ int main(int argc, char** argv) {
     int compression_level = args["level"].as<int>();
     int max_compression = ARRSIZE(configs) - 1;
     compression_level = std::clamp(compression_level, 0, max_compression);
+    int n_threads = std::max(args["processes"].as<int>(), 1);
 
     printf("Input Filename : %s\n", input_filename.c_str());
     printf("Output Filename: %s\n", output_filename.c_str());
     printf("UseFast        : %s\n", use_fast ? "TRUE": "FALSE");
     printf("Level          : %d\n", compression_level);
+    printf("Threads        : %d\n", n_threads);
 
     FileHandle fp = fopen(input_filename.c_str(), "rb");
     if (!fp) {
@@ -1148,9 +2163,6 @@ int main(int argc, char** argv) {
         perror("fopen");
         exit(1);
     }
-    BitWriter writer{out};
-    int block_number = 0;
-
     // +---+---+---+---+---+---+---+---+---+---+
     // |ID1|ID2|CM |FLG|     MTIME     |XFL|OS | (more-->)
     // +---+---+---+---+---+---+---+---+---+---+
@@ -1181,35 +2193,14 @@ int main(int argc, char** argv) {
     // data modulo 2^32.
     uint32_t isize = 0;
 
-    auto* compress_fn = &compress_block;
-    static char buf[BUFSIZE];
-    size_t size = 0;
-    size_t read;
-    const uint8_t* pbuf = reinterpret_cast<const uint8_t*>(&buf[0]);  // TEMP: for convenience
-    while ((read = fread(&buf[size], 1, BUFSIZE - size, fp)) > 0) {
-        crc = calc_crc32(crc, reinterpret_cast<const uint8_t*>(&buf[size]), read);
-        isize += read;
-        size += read;
-        assert(isize <= filesize);
-        while (size >= BLOCKSIZE) {
-            uint8_t bfinal = size <= BLOCKSIZE && isize == filesize;
-            compress_fn(pbuf, BLOCKSIZE, bfinal, use_fast, compression_level, writer, block_number++);
-            size -= BLOCKSIZE;
-            memmove(&buf[0], &buf[BLOCKSIZE], size);
-        }
-    }
-    if (ferror(fp)) {
-        panic("error reading from file");
-    }
-    assert(feof(fp));
-
-    // If the input file is empty, do need to write at least 1 block, which can
-    // contain no data.
-    assert(size < BLOCKSIZE);
-    if (size > 0 || block_number == 0) {
-        compress_fn(pbuf, size, 1, use_fast, compression_level, writer, block_number++);
+    if (n_threads > 1) {
+        BitWriter writer{out};
+        compress_parallel(fp, compression_level, use_fast, n_threads, writer, crc, isize);
+        writer.flush();
+    } else {
+        compress_serial(fp, out, compression_level, use_fast, crc, isize);
     }
-    writer.flush();
+    assert(isize <= filesize);
 
     DEBUG("CRC32 = 0x%08x", crc);
     DEBUG("ISIZE = 0x%08x", isize);
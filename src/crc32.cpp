@@ -1,5 +1,17 @@
 #include "crc32.h"
 
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define CRC32_CLMUL
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
 #define BYFOUR
 #ifdef BYFOUR
 static uint32_t crc32_little(uint32_t crc, const uint8_t *buf, size_t len);
@@ -452,13 +464,178 @@ const uint32_t crc_table[TBLS][256] =
   }
 };
 
+#ifdef CRC32_CLMUL
+
+/*
+   Folding crc32 using carry-less multiplication, following "Fast CRC
+   Computation for Generic Polynomials Using PCLMULQDQ Instruction" (Intel,
+   2009). Each 128-bit lane is folded forward by D bits by multiplying its two
+   halves with x^(D+32) and x^(D-32) mod P (bit-reflected, shifted left by one)
+   and adding in the data D bits further on. The kernels take and return the
+   crc without the pre and post inversion, and need `len` to be a multiple of
+   16 and at least CRC32_CLMUL_MIN.
+ */
+
+#define CLMUL_TARGET __attribute__((target("pclmul,sse2")))
+#define VCLMUL_TARGET __attribute__((target("vpclmulqdq,avx2,pclmul,sse2")))
+
+#define CRC32_CLMUL_MIN 64
+
+typedef uint32_t (*crc32_kernel)(uint32_t crc, const uint8_t *buf, size_t len);
+
+/* fold distance of 128 bits, and of 512 bits for 4 lanes */
+#define K_FOLD1 _mm_set_epi64x(0x00ccaa009e, 0x01751997d0)
+#define K_FOLD4 _mm_set_epi64x(0x01c6e41596, 0x0154442bd4)
+/* fold distance of 1024 bits, for 4 x 2 lanes */
+#define K_FOLD8 _mm256_set_epi64x(0x014a7fe880, 0x01e88ef372, 0x014a7fe880, 0x01e88ef372)
+
+static inline CLMUL_TARGET __m128i load128(const uint8_t *p)
+{
+    return _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+}
+
+static inline CLMUL_TARGET __m128i fold128(__m128i x, __m128i k, __m128i data)
+{
+    return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00), _mm_clmulepi64_si128(x, k, 0x11)),
+                         data);
+}
+
+/* ========================================================================= */
+/* folds the remaining 16 byte blocks into `x1` and reduces it to 32 bits */
+static CLMUL_TARGET uint32_t crc32_clmul_finish(__m128i x1, const uint8_t *buf, size_t len)
+{
+    const __m128i k = K_FOLD1;
+    while (len >= 16) {
+        x1 = fold128(x1, k, load128(buf));
+        buf += 16;
+        len -= 16;
+    }
+
+    /* fold 128 bits to 64 bits */
+    const __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+    __m128i x2 = _mm_clmulepi64_si128(x1, k, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask);
+    x1 = _mm_clmulepi64_si128(x1, _mm_set_epi64x(0, 0x0163cd6124), 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* Barrett reduction to 32 bits */
+    const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+    x2 = _mm_and_si128(x1, mask);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+    x2 = _mm_and_si128(x2, mask);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return static_cast<uint32_t>(_mm_cvtsi128_si32(_mm_srli_si128(x1, 4)));
+}
+
+/* ========================================================================= */
+static CLMUL_TARGET uint32_t crc32_clmul(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    const __m128i k4 = K_FOLD4;
+    __m128i x1 = _mm_xor_si128(load128(buf + 0x00), _mm_cvtsi32_si128(static_cast<int>(crc)));
+    __m128i x2 = load128(buf + 0x10);
+    __m128i x3 = load128(buf + 0x20);
+    __m128i x4 = load128(buf + 0x30);
+    buf += 64;
+    len -= 64;
+
+    while (len >= 64) {
+        x1 = fold128(x1, k4, load128(buf + 0x00));
+        x2 = fold128(x2, k4, load128(buf + 0x10));
+        x3 = fold128(x3, k4, load128(buf + 0x20));
+        x4 = fold128(x4, k4, load128(buf + 0x30));
+        buf += 64;
+        len -= 64;
+    }
+
+    const __m128i k1 = K_FOLD1;
+    x1 = fold128(x1, k1, x2);
+    x1 = fold128(x1, k1, x3);
+    x1 = fold128(x1, k1, x4);
+    return crc32_clmul_finish(x1, buf, len);
+}
+
+/* ========================================================================= */
+static inline VCLMUL_TARGET __m256i load256(const uint8_t *p)
+{
+    return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+}
+
+static inline VCLMUL_TARGET __m256i fold256(__m256i x, __m256i k, __m256i data)
+{
+    return _mm256_xor_si256(
+        _mm256_xor_si256(_mm256_clmulepi64_epi128(x, k, 0x00), _mm256_clmulepi64_epi128(x, k, 0x11)), data);
+}
+
+/* same as crc32_clmul, but folds 8 lanes at a time in 256-bit registers */
+static VCLMUL_TARGET uint32_t crc32_vclmul(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    if (len < 256) {
+        return crc32_clmul(crc, buf, len);
+    }
+
+    const __m256i k8 = K_FOLD8;
+    __m256i y1 = _mm256_xor_si256(load256(buf + 0x00), _mm256_set_epi32(0, 0, 0, 0, 0, 0, 0, static_cast<int>(crc)));
+    __m256i y2 = load256(buf + 0x20);
+    __m256i y3 = load256(buf + 0x40);
+    __m256i y4 = load256(buf + 0x60);
+    buf += 128;
+    len -= 128;
+
+    while (len >= 128) {
+        y1 = fold256(y1, k8, load256(buf + 0x00));
+        y2 = fold256(y2, k8, load256(buf + 0x20));
+        y3 = fold256(y3, k8, load256(buf + 0x40));
+        y4 = fold256(y4, k8, load256(buf + 0x60));
+        buf += 128;
+        len -= 128;
+    }
+
+    /* the lanes are in memory order, fold them into the first one by one */
+    const __m128i k1 = K_FOLD1;
+    __m128i x1 = _mm256_castsi256_si128(y1);
+    x1 = fold128(x1, k1, _mm256_extracti128_si256(y1, 1));
+    x1 = fold128(x1, k1, _mm256_castsi256_si128(y2));
+    x1 = fold128(x1, k1, _mm256_extracti128_si256(y2, 1));
+    x1 = fold128(x1, k1, _mm256_castsi256_si128(y3));
+    x1 = fold128(x1, k1, _mm256_extracti128_si256(y3, 1));
+    x1 = fold128(x1, k1, _mm256_castsi256_si128(y4));
+    x1 = fold128(x1, k1, _mm256_extracti128_si256(y4, 1));
+    return crc32_clmul_finish(x1, buf, len);
+}
+
+/* ========================================================================= */
+/* picks the widest kernel the cpu supports, or nullptr for the table path */
+static crc32_kernel select_crc32_kernel()
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_PCLMUL) || !(edx & bit_SSE2)) {
+        return nullptr;
+    }
+    const bool os_avx = (ecx & bit_OSXSAVE) && (ecx & bit_AVX);
+    if (os_avx && __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_AVX2) && (ecx & bit_VPCLMULQDQ)) {
+        /* the OS also has to save the ymm registers */
+        unsigned int xcr0_lo, xcr0_hi;
+        __asm__("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+        (void)xcr0_hi;
+        if ((xcr0_lo & 6) == 6) {
+            return crc32_vclmul;
+        }
+    }
+    return crc32_clmul;
+}
+
+#endif /* CRC32_CLMUL */
+
 // taken (then modifed) from https://github.com/madler/zlib/blob/master/crc32.c
 
 /* ========================================================================= */
 #define DO1 crc = crc_table[0][(static_cast<int>(crc) ^ (*buf++)) & 0xff] ^ (crc >> 8)
 #define DO8 DO1; DO1; DO1; DO1; DO1; DO1; DO1; DO1
 
-uint32_t calc_crc32(uint32_t crc, const uint8_t *buf, size_t len) noexcept
+static uint32_t crc32_generic(uint32_t crc, const uint8_t *buf, size_t len)
 {
 #ifdef BYFOUR
     if (sizeof(void *) == sizeof(ptrdiff_t)) {
@@ -487,6 +664,216 @@ uint32_t calc_crc32(uint32_t crc, const uint8_t *buf, size_t len) noexcept
     return crc ^ 0xffffffffUL;
 }
 
+uint32_t calc_crc32(uint32_t crc, const uint8_t *buf, size_t len) noexcept
+{
+#ifdef CRC32_CLMUL
+    static const crc32_kernel kernel = select_crc32_kernel();
+    if (kernel && len >= CRC32_CLMUL_MIN) {
+        size_t n = len & ~static_cast<size_t>(15);
+        crc = ~kernel(~crc, buf, n);
+        buf += n;
+        len -= n;
+    }
+#endif
+    return crc32_generic(crc, buf, len);
+}
+
+uint32_t calc_crc32_table(uint32_t crc, const uint8_t *buf, size_t len) noexcept
+{
+    return crc32_generic(crc, buf, len);
+}
+
+// crc32_combine taken from https://github.com/madler/zlib/blob/master/crc32.c
+
+/* ========================================================================= */
+#define POLY 0xedb88320u /* p(x) reflected, with x^32 implied */
+
+/*
+  Return a(x) multiplied by b(x) modulo p(x), where p(x) is the CRC polynomial,
+  reflected. For speed, this requires that a not be zero.
+ */
+static constexpr uint32_t multmodp(uint32_t a, uint32_t b) noexcept
+{
+    uint32_t m = 1u << 31;
+    uint32_t p = 0;
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) {
+                break;
+            }
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ POLY : b >> 1;
+    }
+    return p;
+}
+
+struct x2n_table_t {
+    uint32_t x2n[32]; /* x^2^n mod p(x) */
+
+    constexpr x2n_table_t() noexcept : x2n{}
+    {
+        uint32_t p = 1u << 30; /* x^1 */
+        x2n[0] = p;
+        for (int n = 1; n < 32; n++) {
+            x2n[n] = p = multmodp(p, p);
+        }
+    }
+};
+
+static constexpr x2n_table_t x2n_table{};
+
+/*
+  Return x^(n * 2^k) modulo p(x).
+ */
+static uint32_t x2nmodp(size_t n, unsigned k) noexcept
+{
+    uint32_t p = 1u << 31; /* x^0 == 1 */
+    while (n) {
+        if (n & 1) {
+            p = multmodp(x2n_table.x2n[k & 31], p);
+        }
+        n >>= 1;
+        k++;
+    }
+    return p;
+}
+
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, size_t len2) noexcept
+{
+    return multmodp(x2nmodp(len2, 3), crc1) ^ crc2;
+}
+
+/* ========================================================================= */
+#define PARALLEL_CRC_MIN_CHUNK (1u << 20)
+
+/*
+   Threads kept for calc_crc32_parallel, started as they are first needed and
+   then reused, so that a caller checksumming one large buffer after another
+   doesn't start and join threads for each. A batch is the chunks of one call,
+   the caller checksums chunks of the queue too while it waits for its batch.
+ */
+class crc32_pool
+{
+public:
+    struct job {
+        const uint8_t *buf;
+        size_t len;
+        uint32_t crc;
+        size_t *left; /* chunks of the batch not done yet */
+    };
+
+    /* checksums `jobs` from 0, on up to `nthreads` threads with this one */
+    void run(job *jobs, size_t njobs, unsigned nthreads) noexcept
+    {
+        size_t left = njobs;
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (threads_.size() + 1 < nthreads) {
+            try {
+                threads_.emplace_back([this]() { work(); });
+            } catch (...) {
+                /* unable to start another thread, make do with the others */
+                break;
+            }
+        }
+        for (size_t i = 0; i < njobs; ++i) {
+            jobs[i].left = &left;
+            queue_.push_back(&jobs[i]);
+        }
+        work_.notify_all();
+        while (left > 0) {
+            if (!queue_.empty()) {
+                take(lock);
+            } else {
+                done_.wait(lock);
+            }
+        }
+    }
+
+    ~crc32_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        work_.notify_all();
+        for (auto &thread : threads_) {
+            thread.join();
+        }
+    }
+
+private:
+    void work() noexcept
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (;;) {
+            work_.wait(lock, [this]() { return stop_ || !queue_.empty(); });
+            if (queue_.empty()) {
+                return;
+            }
+            take(lock);
+        }
+    }
+
+    /* checksums the first job of the queue, with `lock` held on entry and exit */
+    void take(std::unique_lock<std::mutex> &lock) noexcept
+    {
+        job *j = queue_.front();
+        queue_.pop_front();
+        lock.unlock();
+        j->crc = calc_crc32(0, j->buf, j->len);
+        lock.lock();
+        if (--*j->left == 0) {
+            done_.notify_all();
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable work_;
+    std::condition_variable done_;
+    std::deque<job *> queue_;
+    std::vector<std::thread> threads_;
+    bool stop_ = false;
+};
+
+uint32_t calc_crc32_parallel(uint32_t crc, const uint8_t *buf, size_t len, unsigned nthreads) noexcept
+{
+    if (nthreads == 0) {
+        nthreads = std::thread::hardware_concurrency();
+    }
+    size_t nchunks = len / PARALLEL_CRC_MIN_CHUNK;
+    if (nchunks > nthreads) {
+        nchunks = nthreads;
+    }
+    if (nchunks < 2) {
+        return calc_crc32(crc, buf, len);
+    }
+
+    // chunk 0 takes any remainder, the chunks all start from 0 and get
+    // combined in order afterwards
+    const size_t chunk = len / nchunks;
+    const size_t first = len - chunk * (nchunks - 1);
+    std::vector<crc32_pool::job> jobs;
+    try {
+        jobs.resize(nchunks);
+    } catch (...) {
+        return calc_crc32(crc, buf, len);
+    }
+    jobs[0].buf = buf;
+    jobs[0].len = first;
+    for (size_t i = 1; i < nchunks; ++i) {
+        jobs[i].buf = buf + first + (i - 1) * chunk;
+        jobs[i].len = chunk;
+    }
+    static crc32_pool pool;
+    pool.run(jobs.data(), nchunks, static_cast<unsigned>(nchunks));
+    for (const auto &job : jobs) {
+        crc = crc32_combine(crc, job.crc, job.len);
+    }
+    return crc;
+}
+
 #ifdef BYFOUR
 
 /*
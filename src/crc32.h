@@ -4,3 +4,16 @@
 #include <cstddef>
 
 uint32_t calc_crc32(uint32_t crc, const uint8_t *buf, size_t len) noexcept;
+
+// Same as `calc_crc32`, but always uses the lookup tables instead of the
+// carry-less multiply kernels the cpu may have, to test those against.
+uint32_t calc_crc32_table(uint32_t crc, const uint8_t *buf, size_t len) noexcept;
+
+// Returns the crc of the concatenation of two buffers, given the crc of each
+// and the length of the second.
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, size_t len2) noexcept;
+
+// Same as `calc_crc32`, but splits `buf` into chunks that are checksummed on
+// up to `nthreads` threads (0 for one per hardware thread) and combined. The
+// threads are started on first use and kept for later calls.
+uint32_t calc_crc32_parallel(uint32_t crc, const uint8_t *buf, size_t len, unsigned nthreads = 0) noexcept;
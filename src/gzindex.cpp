@@ -0,0 +1,313 @@
+#include "gzindex.h"
+
+#ifndef USE_ZLIB
+
+#include <cerrno>
+#include <cstring>
+
+#include "crc32.h"
+
+// Index files start with this, the version is the last digit
+static const char IndexMagic[8] = "PLSIDX2";
+
+size_t PLS_header_size(const Bytef *p, size_t left) {
+    if (left < 18 || p[0] != 0x1f || p[1] != 0x8b || p[2] != 8 || (p[3] & 0xe0) != 0) {
+        return 0;
+    }
+    const Bytef flags = p[3];
+    size_t pos = 10;
+    if (flags & 4) { // FEXTRA
+        pos += 2 + (p[pos] | static_cast<size_t>(p[pos + 1]) << 8);
+    }
+    for (Bytef flag = 8; flag <= 16; flag = static_cast<Bytef>(flag << 1)) { // FNAME, FCOMMENT
+        if (flags & flag) {
+            while (pos < left && p[pos] != 0) {
+                ++pos;
+            }
+            ++pos;
+        }
+    }
+    if (flags & 2) { // FHCRC
+        pos += 2;
+    }
+    return pos < left ? pos : 0;
+}
+
+// A position between two blocks of a gzip file, and the output before it
+struct cursor {
+    const Bytef *data;
+    size_t size;
+    uint64_t in;  // bit offset of the next block
+    uint64_t out; // offset in the output
+    std::vector<Bytef> window;
+    uint32_t crc;   // of the output of the member so far
+    uint64_t isize; // output of the member so far
+    PLS_chunk chunk;
+    std::vector<Bytef> bytes; // output of the last `step`
+    bool trailing;            // data after the last member was ignored
+};
+
+static void start_member(cursor *c, size_t pos) {
+    c->in = pos * 8;
+    c->window.clear();
+    c->crc = 0;
+    c->isize = 0;
+}
+
+// Decodes blocks until the first one that ends past `limit` bytes of output,
+// or the final block of the member, into `c->bytes`. Returns an error
+// message, or nullptr.
+static const char *step(cursor *c, size_t limit, int check) {
+    const char *msg = nullptr;
+    if (PLS_decode_chunk(c->data, c->size, c->in, UINT64_MAX, limit, c->window.size(), &c->chunk, &msg) != Z_OK) {
+        return msg;
+    }
+    std::vector<Bytef> &bytes = c->bytes;
+    bytes.resize(c->chunk.out.size());
+    if (!PLS_resolve_chunk(&c->chunk, c->window.data(), c->window.size(), bytes.data())) {
+        return "invalid distance too far back";
+    }
+    if (check) {
+        c->crc = calc_crc32(c->crc, bytes.data(), bytes.size());
+    }
+    if (bytes.size() >= PLS_WindowSize) {
+        c->window.assign(bytes.end() - PLS_WindowSize, bytes.end());
+    } else {
+        c->window.insert(c->window.end(), bytes.begin(), bytes.end());
+        if (c->window.size() > PLS_WindowSize) {
+            c->window.erase(c->window.begin(), c->window.end() - PLS_WindowSize);
+        }
+    }
+    c->in = c->chunk.end;
+    c->out += bytes.size();
+    c->isize += bytes.size();
+    return nullptr;
+}
+
+// Moves past the trailer of the member whose final block was just decoded to
+// the first block of the next one, or sets `*done` at the end of the file or
+// at data that doesn't start with the gzip magic, which is ignored as by gzip.
+// The trailer is only checked with `verify`, when the whole member was
+// decoded, and its crc only with `check`. Returns an error message, or
+// nullptr.
+static const char *next_member(cursor *c, bool verify, int check, bool *done) {
+    const size_t trailer = (c->in + 7) / 8;
+    if (trailer > c->size || c->size - trailer < 8) {
+        return "unexpected end of input";
+    }
+    const Bytef *p = c->data + trailer;
+    const uint32_t crc = p[0] | p[1] << 8 | p[2] << 16 | static_cast<uint32_t>(p[3]) << 24;
+    const uint32_t isize = p[4] | p[5] << 8 | p[6] << 16 | static_cast<uint32_t>(p[7]) << 24;
+    if (verify && check && crc != c->crc) {
+        return "crc check failed";
+    }
+    if (verify && isize != static_cast<uint32_t>(c->isize)) {
+        return "original size does not match inflated size";
+    }
+    const size_t pos = trailer + 8;
+    *done = pos == c->size;
+    if (*done) {
+        return nullptr;
+    }
+    if (c->size - pos < 2 || c->data[pos] != 0x1f || c->data[pos + 1] != 0x8b) {
+        c->trailing = true;
+        *done = true;
+        return nullptr;
+    }
+    const size_t header = PLS_header_size(c->data + pos, c->size - pos);
+    if (header == 0) {
+        return "invalid gzip header";
+    }
+    start_member(c, pos + header);
+    return nullptr;
+}
+
+static uint32_t file_tag(const Bytef *data, size_t size) {
+    if (size <= 2 * PLS_TagSize) {
+        return calc_crc32(0, data, size);
+    }
+    const uint32_t crc = calc_crc32(0, data, PLS_TagSize);
+    return calc_crc32(crc, data + size - PLS_TagSize, PLS_TagSize);
+}
+
+bool PLS_index_matches(const PLS_index *index, const Bytef *data, size_t size) {
+    return index->size == size && index->tag == file_tag(data, size);
+}
+
+int PLS_build_index(const Bytef *data, size_t size, uint64_t span, int check, FILE *dst, PLS_index *index,
+                    const char **msg) {
+    index->span = span;
+    index->size = size;
+    index->tag = file_tag(data, size);
+    index->points.clear();
+    const size_t header = PLS_header_size(data, size);
+    if (header == 0) {
+        *msg = "invalid gzip header";
+        return Z_DATA_ERROR;
+    }
+    cursor c;
+    c.data = data;
+    c.size = size;
+    c.out = 0;
+    c.trailing = false;
+    start_member(&c, header);
+    for (;;) {
+        if (index->points.empty() || c.out - index->points.back().out >= span) {
+            index->points.push_back({c.in, c.out, c.window});
+        }
+        *msg = step(&c, span, check);
+        if (*msg != nullptr) {
+            return Z_DATA_ERROR;
+        }
+        if (dst && !c.bytes.empty() &&
+            (fwrite(c.bytes.data(), 1, c.bytes.size(), dst) != c.bytes.size() || ferror(dst))) {
+            *msg = strerror(errno);
+            return Z_ERRNO;
+        }
+        if (c.chunk.final) {
+            bool done;
+            *msg = next_member(&c, true, check, &done);
+            if (*msg != nullptr) {
+                return Z_DATA_ERROR;
+            }
+            if (done) {
+                break;
+            }
+        }
+    }
+    if (c.trailing) {
+        *msg = "trailing garbage ignored";
+    }
+    return Z_OK;
+}
+
+static bool put_u64(FILE *fp, uint64_t v) {
+    Bytef b[8];
+    for (size_t i = 0; i < 8; ++i) {
+        b[i] = static_cast<Bytef>(v >> (8 * i));
+    }
+    return fwrite(b, 1, sizeof(b), fp) == sizeof(b);
+}
+
+static bool get_u64(FILE *fp, uint64_t *v) {
+    Bytef b[8];
+    if (fread(b, 1, sizeof(b), fp) != sizeof(b)) {
+        return false;
+    }
+    *v = 0;
+    for (size_t i = 0; i < 8; ++i) {
+        *v |= static_cast<uint64_t>(b[i]) << (8 * i);
+    }
+    return true;
+}
+
+// The index file is the magic followed by little endian 64 bit words: the
+// span, the size and tag of the gzip file and the number of checkpoints,
+// then for each checkpoint its bit offset, output offset, window size and
+// window.
+bool PLS_save_index(const PLS_index *index, const char *path) {
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        return false;
+    }
+    bool ok = fwrite(IndexMagic, 1, sizeof(IndexMagic), fp) == sizeof(IndexMagic) && put_u64(fp, index->span) &&
+              put_u64(fp, index->size) && put_u64(fp, index->tag) && put_u64(fp, index->points.size());
+    for (size_t i = 0; ok && i < index->points.size(); ++i) {
+        const PLS_point &point = index->points[i];
+        ok = put_u64(fp, point.in) && put_u64(fp, point.out) && put_u64(fp, point.window.size()) &&
+             (point.window.empty() || fwrite(point.window.data(), 1, point.window.size(), fp) == point.window.size());
+    }
+    if (fclose(fp) != 0) {
+        ok = false;
+    }
+    return ok;
+}
+
+bool PLS_load_index(PLS_index *index, const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        return false;
+    }
+    char magic[sizeof(IndexMagic)];
+    uint64_t tag = 0;
+    uint64_t count = 0;
+    bool ok = fread(magic, 1, sizeof(magic), fp) == sizeof(magic) &&
+              memcmp(magic, IndexMagic, sizeof(magic)) == 0 && get_u64(fp, &index->span) &&
+              get_u64(fp, &index->size) && get_u64(fp, &tag) && get_u64(fp, &count);
+    index->tag = static_cast<uint32_t>(tag);
+    index->points.clear();
+    for (uint64_t i = 0; ok && i < count; ++i) {
+        PLS_point point;
+        uint64_t wsize = 0;
+        ok = get_u64(fp, &point.in) && get_u64(fp, &point.out) && get_u64(fp, &wsize) && wsize <= PLS_WindowSize;
+        if (ok) {
+            point.window.resize(wsize);
+            ok = wsize == 0 || fread(point.window.data(), 1, wsize, fp) == wsize;
+            index->points.push_back(std::move(point));
+        }
+    }
+    fclose(fp);
+    return ok && !index->points.empty();
+}
+
+int PLS_extract(const Bytef *data, size_t size, const PLS_index *index, uint64_t offset, uint64_t length,
+                FILE *dst, const char **msg) {
+    const std::vector<PLS_point> &points = index->points;
+    if (points.empty()) {
+        *msg = "empty index";
+        return Z_STREAM_ERROR;
+    }
+    size_t lo = 0;
+    size_t hi = points.size();
+    while (hi - lo > 1) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (points[mid].out <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    cursor c;
+    c.data = data;
+    c.size = size;
+    c.in = points[lo].in;
+    c.out = points[lo].out;
+    c.window = points[lo].window;
+    c.crc = 0;
+    c.isize = 0;
+    c.trailing = false;
+    const size_t limit = index->span > 0 ? index->span : PLS_WindowSize;
+    while (length > 0) {
+        *msg = step(&c, limit, 0);
+        if (*msg != nullptr) {
+            return Z_DATA_ERROR;
+        }
+        if (c.out > offset) {
+            const uint64_t begin = c.out - c.bytes.size();
+            const size_t skip = offset > begin ? offset - begin : 0;
+            const size_t n = c.bytes.size() - skip < length ? c.bytes.size() - skip : length;
+            if (fwrite(c.bytes.data() + skip, 1, n, dst) != n || ferror(dst)) {
+                *msg = strerror(errno);
+                return Z_ERRNO;
+            }
+            offset += n;
+            length -= n;
+        }
+        if (c.chunk.final) {
+            bool done;
+            *msg = next_member(&c, false, 0, &done);
+            if (*msg != nullptr) {
+                return Z_DATA_ERROR;
+            }
+            if (done) {
+                break;
+            }
+        }
+    }
+    if (c.trailing) {
+        *msg = "trailing garbage ignored";
+    }
+    return Z_OK;
+}
+
+#endif
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "plschunk.h"
+
+#ifndef USE_ZLIB
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+// Random access into gzip files through checkpoints recorded while decoding,
+// in the manner of zlib's examples/zran.c. Decoding can restart at any
+// checkpoint instead of at the start of the file.
+
+// A block boundary in the deflate stream of a member, and the output before it.
+struct PLS_point {
+    uint64_t in;               // bit offset in the file of the block that starts here
+    uint64_t out;              // offset in the output
+    std::vector<Bytef> window; // last (up to 32K) bytes of output of the member before `out`
+};
+
+struct PLS_index {
+    uint64_t span; // bytes of output between checkpoints
+    uint64_t size; // size of the file the index was built for
+    uint32_t tag;  // crc of the start and end of that file, see `PLS_index_matches`
+    std::vector<PLS_point> points;
+};
+
+// Returns the size of the gzip member header at `p`, or 0 if there isn't a
+// valid and complete one in the `left` bytes.
+size_t PLS_header_size(const Bytef *p, size_t left);
+
+// Decodes all members of the gzip file `data`, writing the output to `dst`
+// unless it's null, and records a checkpoint at the start and about every
+// `span` bytes of output after. The crc of each member is only checked if
+// `check` is set. Data after the last member that doesn't start with the
+// gzip magic is ignored. Returns Z_OK, with `*msg` set to a warning if any
+// was, or an error with `*msg` set.
+int PLS_build_index(const Bytef *data, size_t size, uint64_t span, int check, FILE *dst, PLS_index *index,
+                    const char **msg);
+
+// Writes `index` to the file at `path`, or reads it back. Return false on
+// failure, with errno set for I/O errors.
+bool PLS_save_index(const PLS_index *index, const char *path);
+bool PLS_load_index(PLS_index *index, const char *path);
+
+// Returns true if `index` was built for the `size` bytes at `data`, going by
+// the size and a crc of the first and last `PLS_TagSize` bytes, which take in
+// the header of the first member and the trailer of the last.
+static constexpr size_t PLS_TagSize = 65536;
+bool PLS_index_matches(const PLS_index *index, const Bytef *data, size_t size);
+
+// Writes `length` bytes of the output of the gzip file `data` from `offset`
+// on to `dst`, or fewer if the output ends first, decoding from the last
+// checkpoint at or before `offset`. Trailing data is ignored as by
+// `PLS_build_index`. Returns Z_OK, with `*msg` set to a warning if any was
+// reached, or an error with `*msg` set.
+int PLS_extract(const Bytef *data, size_t size, const PLS_index *index, uint64_t offset, uint64_t length,
+                FILE *dst, const char **msg);
+#endif
@@ -1,8 +1,23 @@
 #include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <climits>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <future>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include "crc32.h"
+#include "gzindex.h"
+#include "plschunk.h"
 #include "plszip.h"
 
 /* -------------------------------------------------------------------------- */
@@ -27,6 +42,437 @@ const char *xlaterc(int rc) {
 // #define SIZE 1U
 #define PARSE_GZIP 16
 
+// the most -p and --index take, the latter in MiB
+#define MAX_THREADS 1024U
+#define MAX_SPAN_MIB (1U << 20)
+
+// TEMP TEMP: use different name to not confuse gdb
+static int do_inflate(z_streamp strm) {
+#ifdef USE_ZLIB
+    return inflate(strm, Z_NO_FLUSH);
+#else
+    return PLS_inflate(strm, Z_NO_FLUSH);
+#endif
+}
+
+// A member decoded on its own thread holds at most about this much output,
+// the rest of it is decoded as it's written out, see `finish_member`.
+#define MEMBER_LIMIT (16U << 20)
+
+struct StreamEnd {
+    void operator()(z_stream *strm) const noexcept {
+        inflateEnd(strm);
+        delete strm;
+    }
+};
+
+// A gzip member decoded on its own by `decode_member`
+struct Member {
+    int ret;     // Z_STREAM_END if the whole member decoded and checked out
+    size_t end;  // offset in the input just past the member
+    std::vector<unsigned char> out;
+    const char *msg;
+    size_t pos;  // offset of the input not yet given to `strm`
+    std::unique_ptr<z_stream, StreamEnd> strm; // still open if the member was cut short
+};
+
+// Decodes up to `avail` bytes of `member` into `out`, feeding its stream
+// input as needed, and sets `*have` to how many it did. Returns false on an
+// error, with `member->ret` and `member->msg` set.
+static bool decode_some(const Bytef *data, size_t size, Member *member, Bytef *out, uInt avail, uInt *have) {
+    z_stream *strm = member->strm.get();
+    *have = 0;
+    if (strm->avail_in == 0) {
+        if (member->pos == size) {
+            member->ret = Z_BUF_ERROR;
+            member->msg = "unexpected end of input";
+            return false;
+        }
+        strm->next_in = data + member->pos;
+        strm->avail_in = static_cast<uInt>(size - member->pos < UINT_MAX ? size - member->pos : UINT_MAX);
+        member->pos += strm->avail_in;
+    }
+    strm->next_out = out;
+    strm->avail_out = avail;
+    member->ret = do_inflate(strm);
+    *have = avail - strm->avail_out;
+    if (member->ret != Z_OK && member->ret != Z_STREAM_END && member->ret != Z_BUF_ERROR) {
+        member->msg = strm->msg;
+        return false;
+    }
+    return true;
+}
+
+// Closes the stream of `member`, which has ended or failed.
+static void close_member(Member *member) {
+    member->end = member->pos - member->strm->avail_in;
+    member->strm.reset();
+}
+
+// Decodes the gzip member starting at `offset` of the `size` bytes at `data`,
+// or only its first MEMBER_LIMIT bytes or so, leaving `strm` open.
+static Member decode_member(const Bytef *data, size_t size, size_t offset, int check) {
+    Member member{Z_OK, offset, {}, nullptr, offset, nullptr};
+    z_stream *strm = new z_stream;
+    strm->zalloc = Z_NULL;
+    strm->zfree = Z_NULL;
+    strm->opaque = Z_NULL;
+    member.ret = inflateInit2(strm, 15 + 16);
+    if (member.ret != Z_OK) {
+        member.msg = strm->msg;
+        delete strm;
+        return member;
+    }
+    member.strm.reset(strm);
+    if (!check) {
+        inflateValidate(strm, 0);
+    }
+    strm->avail_in = 0;
+    size_t have = 0;
+    bool ok;
+    do {
+        member.out.resize(have + 4 * SIZE);
+        uInt n;
+        ok = decode_some(data, size, &member, member.out.data() + have, 4 * SIZE, &n);
+        have += n;
+    } while (ok && member.ret != Z_STREAM_END && have < MEMBER_LIMIT);
+    member.out.resize(have);
+    if (!ok || member.ret == Z_STREAM_END) {
+        close_member(&member);
+    }
+    return member;
+}
+
+// Writes the output of `member`, which starts at `offset`, so far to `dst`,
+// then decodes the rest of it there if it was cut short. Returns 0, or an
+// error after printing it.
+static int finish_member(const Bytef *data, size_t size, size_t offset, Member *member, FILE *dst) {
+    if (!member->out.empty() &&
+        (fwrite(member->out.data(), 1, member->out.size(), dst) != member->out.size() || ferror(dst))) {
+        fprintf(stderr, "write error: %s\n", strerror(errno));
+        return errno;
+    }
+    if (member->strm) {
+        std::vector<Bytef> buf(4 * SIZE);
+        bool ok;
+        do {
+            uInt n;
+            ok = decode_some(data, size, member, buf.data(), 4 * SIZE, &n);
+            if (n > 0 && (fwrite(buf.data(), 1, n, dst) != n || ferror(dst))) {
+                fprintf(stderr, "write error: %s\n", strerror(errno));
+                return errno;
+            }
+        } while (ok && member->ret != Z_STREAM_END);
+        close_member(member);
+    }
+    if (member->ret != Z_STREAM_END) {
+        fprintf(stderr, "inflate error[%d] in member at offset %zu: %s\n", member->ret, offset,
+                member->msg ? member->msg : "unknown error");
+        return member->ret;
+    }
+    return 0;
+}
+
+// Whether the `left` bytes at `p`, which follow a member, start with the gzip
+// magic of another one. If not, like zero padding, the rest of the input is
+// trailing garbage that is ignored with a warning, as gzip does.
+static bool is_next_member(const Bytef *p, size_t left) {
+    return left >= 2 && p[0] == 0x1f && p[1] == 0x8b;
+}
+
+// Whether `p` looks like the start of a gzip member: the magic bytes, deflate,
+// no reserved flags and known XFL and OS values.
+static bool is_member_start(const Bytef *p, size_t left) {
+    return left >= 18 && p[0] == 0x1f && p[1] == 0x8b && p[2] == 8 && (p[3] & 0xe0) == 0 &&
+           (p[8] == 0 || p[8] == 2 || p[8] == 4) && (p[9] <= 13 || p[9] == 255);
+}
+
+#ifndef USE_ZLIB
+// A member is decoded in pieces of this many bytes of compressed data, and a
+// piece is cut short at the first block to end past this many symbols, so
+// that highly compressible input doesn't hold too much output in memory.
+#define CHUNK_SIZE (4U << 20)
+#define CHUNK_LIMIT (8 * CHUNK_SIZE)
+
+// Decodes the gzip member at `offset` of the `size` bytes at `data` on
+// `nthreads` threads by splitting its deflate stream into pieces of
+// CHUNK_SIZE bytes. Every piece but the first is decoded on its own thread
+// from the first bit in it that starts a dynamic huffman block which decodes
+// cleanly, with back-references to the unknown output before it kept as
+// markers. Going in order, a piece is taken once the output before it has
+// ended on the block it starts at, and its markers are filled in from the
+// last 32K of that output. Pieces that began at a false start are dropped and
+// whatever isn't covered is decoded on this thread. Pieces are only cut up
+// to `limit`, where the next member is expected to start. Sets `*end` to the
+// offset just past the member.
+static int inflate_blocks(const Bytef *data, size_t size, size_t offset, size_t limit, FILE *dst, int check,
+                          unsigned nthreads, size_t *end) {
+    const size_t header = PLS_header_size(data + offset, size - offset);
+    if (header == 0) {
+        fprintf(stderr, "inflate error in member at offset %zu: invalid gzip header\n", offset);
+        return Z_DATA_ERROR;
+    }
+    const size_t first = offset + header;
+    const size_t npieces = limit > first ? (limit - first + CHUNK_SIZE - 1) / CHUNK_SIZE : 0;
+
+    // Searches still running past the final block, or after an error, are
+    // told to give up so that waiting for them on the way out is short.
+    std::atomic<bool> cancel{false};
+    struct Canceller {
+        std::atomic<bool> &flag;
+        ~Canceller() { flag = true; }
+    };
+    std::deque<std::future<PLS_chunk>> pending;
+    Canceller canceller{cancel};
+    size_t next = 1;
+    PLS_chunk ahead;
+    bool have_ahead = false;
+    PLS_chunk chunk;
+    chunk.final = false;
+    std::vector<Bytef> bytes;
+    std::vector<Bytef> window;
+    uint32_t crc = 0;
+    size_t total = 0;
+    uint64_t pos = first * 8;
+    while (!chunk.final) {
+        while (pending.size() < nthreads && next < npieces) {
+            const uint64_t from = (first + next * CHUNK_SIZE) * 8;
+            const uint64_t to = std::min<uint64_t>(from + CHUNK_SIZE * 8, limit * 8);
+            pending.push_back(std::async(std::launch::async, [=, &cancel] {
+                PLS_chunk piece;
+                if (!PLS_find_chunk(data, size, from, to, to, CHUNK_LIMIT, &cancel, &piece)) {
+                    // nothing found, stand in for a piece that starts past the range
+                    piece.begin = piece.end = to;
+                    piece.final = false;
+                }
+                return piece;
+            }));
+            ++next;
+        }
+        if (!have_ahead && !pending.empty()) {
+            ahead = pending.front().get();
+            pending.pop_front();
+            have_ahead = true;
+        }
+        if (have_ahead && ahead.begin < pos) {
+            have_ahead = false;
+            continue;
+        }
+        if (have_ahead && ahead.begin == pos && ahead.end > pos) {
+            std::swap(chunk, ahead);
+            have_ahead = false;
+        } else {
+            const uint64_t stop = have_ahead ? ahead.begin : UINT64_MAX;
+            const char *msg = nullptr;
+            int ret = PLS_decode_chunk(data, size, pos, stop, CHUNK_LIMIT, window.size(), &chunk, &msg);
+            if (ret != Z_OK) {
+                fprintf(stderr, "inflate error[%d] in member at offset %zu: %s\n", ret, offset, msg);
+                return ret;
+            }
+        }
+        bytes.resize(chunk.out.size());
+        if (!PLS_resolve_chunk(&chunk, window.data(), window.size(), bytes.data())) {
+            fprintf(stderr, "inflate error in member at offset %zu: invalid distance too far back\n", offset);
+            return Z_DATA_ERROR;
+        }
+        // pieces run to many MiB and this thread is the one the others
+        // wait on, so their crc is split up as well
+        if (check) {
+            crc = calc_crc32_parallel(crc, bytes.data(), bytes.size(), nthreads);
+        }
+        total += bytes.size();
+        if (!bytes.empty() && (fwrite(bytes.data(), 1, bytes.size(), dst) != bytes.size() || ferror(dst))) {
+            fprintf(stderr, "write error: %s\n", strerror(errno));
+            return errno;
+        }
+        if (bytes.size() >= PLS_WindowSize) {
+            window.assign(bytes.end() - PLS_WindowSize, bytes.end());
+        } else {
+            window.insert(window.end(), bytes.begin(), bytes.end());
+            if (window.size() > PLS_WindowSize) {
+                window.erase(window.begin(), window.end() - PLS_WindowSize);
+            }
+        }
+        pos = chunk.end;
+    }
+    const size_t trailer = (pos + 7) / 8;
+    if (trailer > size || size - trailer < 8) {
+        fprintf(stderr, "inflate error in member at offset %zu: unexpected end of input\n", offset);
+        return Z_BUF_ERROR;
+    }
+    const Bytef *p = data + trailer;
+    const uint32_t stored_crc = p[0] | p[1] << 8 | p[2] << 16 | static_cast<uint32_t>(p[3]) << 24;
+    const uint32_t isize = p[4] | p[5] << 8 | p[6] << 16 | static_cast<uint32_t>(p[7]) << 24;
+    if (check && stored_crc != crc) {
+        fprintf(stderr, "inflate error in member at offset %zu: crc check failed\n", offset);
+        return Z_DATA_ERROR;
+    }
+    if (isize != static_cast<uint32_t>(total)) {
+        fprintf(stderr, "inflate error in member at offset %zu: original size does not match inflated size\n",
+                offset);
+        return Z_DATA_ERROR;
+    }
+    *end = trailer + 8;
+    return 0;
+}
+#endif
+
+#ifndef USE_ZLIB
+// Decodes `data` to `dst` and saves an index of it with a checkpoint every
+// `span` bytes of output, next to the input as IN.idx.
+static int write_index(const Bytef *data, size_t size, const char *inname, uint64_t span, int check, FILE *dst) {
+    PLS_index index;
+    const char *msg = nullptr;
+    int ret = PLS_build_index(data, size, span, check, dst, &index, &msg);
+    if (ret != Z_OK) {
+        fprintf(stderr, "inflate error[%d]: %s\n", ret, msg);
+        return ret;
+    }
+    if (msg) {
+        fprintf(stderr, "warning: %s\n", msg);
+    }
+    const std::string name = std::string(inname) + ".idx";
+    if (!PLS_save_index(&index, name.c_str())) {
+        fprintf(stderr, "error: unable to write index %s: %s\n", name.c_str(), strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+// Writes `length` bytes of the output of `data` from `offset` on to `dst`,
+// starting from the nearest checkpoint in the index next to the input, or
+// from the start if there isn't an index for it.
+static int extract_range(const Bytef *data, size_t size, const char *inname, uint64_t offset, uint64_t length,
+                         FILE *dst) {
+    PLS_index index;
+    const std::string name = std::string(inname) + ".idx";
+    if (!PLS_load_index(&index, name.c_str()) || !PLS_index_matches(&index, data, size)) {
+        fprintf(stderr, "warning: no usable index %s, decoding from the start\n", name.c_str());
+        const size_t header = PLS_header_size(data, size);
+        if (header == 0) {
+            fprintf(stderr, "inflate error: invalid gzip header\n");
+            return Z_DATA_ERROR;
+        }
+        index.span = CHUNK_SIZE;
+        index.points.assign(1, PLS_point{header * 8, 0, {}});
+    }
+    const char *msg = nullptr;
+    int ret = PLS_extract(data, size, &index, offset, length, dst, &msg);
+    if (ret != Z_OK) {
+        fprintf(stderr, "inflate error[%d]: %s\n", ret, msg);
+        return ret;
+    }
+    if (msg) {
+        fprintf(stderr, "warning: %s\n", msg);
+    }
+    return 0;
+}
+#endif
+
+// Decodes the multi-member gzip file `data` on `nthreads` threads. Every
+// offset that looks like the start of a member is decoded as one on its own
+// thread, ahead of the members being written. Going from the start of the
+// file, the member found at the end of the previous one is the next real
+// one, and candidates that fall inside a member were false starts, their
+// work is dropped. A large member is decoded in pieces on `nthreads` threads
+// instead (see `inflate_blocks`) once it's the next one to be written, and a
+// member that doesn't start at a candidate is decoded on this thread. Up to
+// `nthreads` members, each cut short at MEMBER_LIMIT bytes of output, are
+// held in memory.
+static int inflate_parallel(const Bytef *data, size_t size, FILE *dst, int check, unsigned nthreads) {
+    std::vector<size_t> starts;
+    for (size_t i = 0; i < size; ++i) {
+        const void *p = memchr(data + i, 0x1f, size - i);
+        if (p == nullptr) {
+            break;
+        }
+        i = static_cast<size_t>(static_cast<const Bytef *>(p) - data);
+        if (is_member_start(data + i, size - i)) {
+            starts.push_back(i);
+        }
+    }
+
+    // The member at starts[k] is decoded in pieces instead if it's the only
+    // one, or the next candidate is far enough off for it to be large.
+    auto split = [&](size_t k) {
+#ifdef USE_ZLIB
+        (void)k;
+        return false;
+#else
+        const size_t end = k + 1 < starts.size() ? starts[k + 1] : size;
+        return starts.size() == 1 || end - starts[k] > 2 * CHUNK_SIZE;
+#endif
+    };
+
+    std::deque<std::pair<size_t, std::future<Member>>> pending;
+    size_t next = 0;
+    size_t pos = 0;
+    while (pos < size) {
+        while (pending.size() < nthreads && next < starts.size()) {
+            const size_t k = next++;
+            if (starts[k] >= pos && !split(k)) {
+                pending.emplace_back(starts[k],
+                                     std::async(std::launch::async, decode_member, data, size, starts[k], check));
+            }
+        }
+        Member member;
+        if (!pending.empty() && pending.front().first < pos) {
+            pending.front().second.wait();
+            pending.pop_front();
+            continue;
+        } else if (!pending.empty() && pending.front().first == pos) {
+            member = pending.front().second.get();
+            pending.pop_front();
+        } else {
+#ifndef USE_ZLIB
+            const auto it = std::lower_bound(starts.begin(), starts.end(), pos);
+            if (it != starts.end() && *it == pos && split(static_cast<size_t>(it - starts.begin()))) {
+                // pieces share the threads with the members queued after it
+                const size_t limit = it + 1 != starts.end() ? *(it + 1) : size;
+                const size_t busy = std::min<size_t>(pending.size(), nthreads - 1);
+                const unsigned budget = nthreads - static_cast<unsigned>(busy);
+                int ret = inflate_blocks(data, size, pos, limit, dst, check, budget, &pos);
+                if (ret != 0) {
+                    return ret;
+                }
+                if (pos < size && !is_next_member(data + pos, size - pos)) {
+                    fprintf(stderr, "warning: trailing garbage ignored\n");
+                    break;
+                }
+                continue;
+            }
+#endif
+            member = decode_member(data, size, pos, check);
+        }
+        int ret = finish_member(data, size, pos, &member, dst);
+        if (ret != 0) {
+            return ret;
+        }
+        pos = member.end;
+        if (pos < size && !is_next_member(data + pos, size - pos)) {
+            fprintf(stderr, "warning: trailing garbage ignored\n");
+            break;
+        }
+    }
+    return 0;
+}
+
+// Parses all of `arg` as a decimal number in [min, max] into `*value`.
+// Returns false, leaving `*value` alone, if it isn't one.
+static bool parse_number(const char *arg, uint64_t min, uint64_t max, uint64_t *value) {
+    if (!isdigit(static_cast<unsigned char>(arg[0]))) {
+        return false;
+    }
+    char *end;
+    errno = 0;
+    const unsigned long long v = strtoull(arg, &end, 10);
+    if (errno != 0 || *end != '\0' || v < min || v > max) {
+        return false;
+    }
+    *value = v;
+    return true;
+}
+
 int main(int argc, char **argv) {
     static char ibuf[SIZE];
     static char obuf[SIZE];
@@ -34,10 +480,69 @@ int main(int argc, char **argv) {
     FILE *src, *dst;
     size_t have;
     int ret = 0;
+    int check = 1;
+    unsigned nthreads = 1;
+    uint64_t span = 0;
+    bool seek = false;
+#ifndef USE_ZLIB
+    uint64_t offset = 0;
+    uint64_t length = UINT64_MAX;
+#endif
     z_stream strm;
 
-    printf("inflate: %s\n", zlibVersion());
-
+    for (;;) {
+        // --no-check skips crc verification, only use it for trusted input
+        if (argc > 1 && strcmp(argv[1], "--no-check") == 0) {
+            check = 0;
+            argc--;
+            argv++;
+        // -p N decodes the members of a multi-member file, or pieces of a
+        // large one, on N threads
+        } else if (argc > 2 && strcmp(argv[1], "-p") == 0) {
+            uint64_t n;
+            if (!parse_number(argv[2], 1, MAX_THREADS, &n)) {
+                fprintf(stderr, "error: -p takes a number of threads from 1 to %u, not %s\n", MAX_THREADS, argv[2]);
+                return 1;
+            }
+            nthreads = static_cast<unsigned>(n);
+            argc -= 2;
+            argv += 2;
+#ifndef USE_ZLIB
+        // --index N also saves an index of IN to IN.idx, with a checkpoint
+        // every N MiB of output
+        } else if (argc > 2 && strcmp(argv[1], "--index") == 0) {
+            uint64_t mib;
+            if (!parse_number(argv[2], 1, MAX_SPAN_MIB, &mib)) {
+                fprintf(stderr, "error: --index takes a number of MiB from 1 to %u, not %s\n", MAX_SPAN_MIB,
+                        argv[2]);
+                return 1;
+            }
+            span = mib << 20;
+            argc -= 2;
+            argv += 2;
+        // --offset X and --length Y only write Y bytes of output from X on,
+        // decoding from the nearest checkpoint in IN.idx
+        } else if (argc > 2 && strcmp(argv[1], "--offset") == 0) {
+            if (!parse_number(argv[2], 0, UINT64_MAX, &offset)) {
+                fprintf(stderr, "error: --offset takes a number of bytes, not %s\n", argv[2]);
+                return 1;
+            }
+            seek = true;
+            argc -= 2;
+            argv += 2;
+        } else if (argc > 2 && strcmp(argv[1], "--length") == 0) {
+            if (!parse_number(argv[2], 0, UINT64_MAX, &length)) {
+                fprintf(stderr, "error: --length takes a number of bytes, not %s\n", argv[2]);
+                return 1;
+            }
+            seek = true;
+            argc -= 2;
+            argv += 2;
+#endif
+        } else {
+            break;
+        }
+    }
     if (argc == 2) {
         inname = argv[1];
         outname = NULL;
@@ -45,10 +550,14 @@ int main(int argc, char **argv) {
         inname = argv[1];
         outname = argv[2];
     } else {
-        fprintf(stderr, "usage: %s [IN] [OUT]?\n", argv[0]);
+        fprintf(stderr, "usage: %s [--no-check] [-p N] [--index N] [--offset X] [--length Y] [IN] [OUT]?\n",
+                argv[0]);
         return 0;
     }
 
+    // the output itself may go to stdout
+    fprintf(outname ? stdout : stderr, "inflate: %s\n", zlibVersion());
+
     src = fopen(inname, "rb");
     dst = outname ? fopen(outname, "wb") : stdout;
     if (!src || !dst) {
@@ -58,6 +567,36 @@ int main(int argc, char **argv) {
         return 1;
     }
 
+    if (nthreads > 1 || span > 0 || seek) {
+        struct stat st;
+        void *data = MAP_FAILED;
+        if (fstat(fileno(src), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            data = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fileno(src), 0);
+        }
+        // otherwise (a pipe, say) members are decoded one after another below
+        if (data != MAP_FAILED) {
+            const Bytef *in = static_cast<const Bytef *>(data);
+            const size_t size = static_cast<size_t>(st.st_size);
+#ifndef USE_ZLIB
+            if (span > 0) {
+                ret = write_index(in, size, inname, span, check, dst);
+            } else if (seek) {
+                ret = extract_range(in, size, inname, offset, length, dst);
+            } else
+#endif
+            {
+                ret = inflate_parallel(in, size, dst, check, nthreads);
+            }
+            munmap(data, size);
+            goto exit;
+        }
+        if (span > 0 || seek) {
+            fprintf(stderr, "error: --index and --offset need a regular input file\n");
+            ret = 1;
+            goto exit;
+        }
+    }
+
     strm.zalloc = Z_NULL;
     strm.zfree = Z_NULL;
     strm.opaque = Z_NULL;
@@ -66,26 +605,41 @@ int main(int argc, char **argv) {
         fprintf(stderr, "error: failed to initialize inflate library: %s\n", strm.msg);
         goto exit;
     }
+    if (!check) {
+        inflateValidate(&strm, 0);
+    }
 
-    do {
-        strm.avail_in = static_cast<uInt>(fread(ibuf, 1, SIZE, src));
-        if (ferror(src)) {
-            ret = errno;
-            inflateEnd(&strm);
-            fprintf(stderr, "error reading from input: %s\n", strerror(ret));
-            goto exit;
+    // A file can hold several gzip members back to back, each one is decoded
+    // from where the previous one ended after resetting the stream.
+    strm.avail_in = 0;
+    for (;;) {
+        // between members, keep at least the 2 bytes of magic to look at
+        if (strm.avail_in == 0 || (ret == Z_STREAM_END && strm.avail_in == 1)) {
+            const uInt keep = strm.avail_in;
+            if (keep) {
+                ibuf[0] = static_cast<char>(*strm.next_in);
+            }
+            strm.avail_in = keep + static_cast<uInt>(fread(ibuf + keep, 1, SIZE - keep, src));
+            if (ferror(src)) {
+                ret = errno;
+                inflateEnd(&strm);
+                fprintf(stderr, "error reading from input: %s\n", strerror(ret));
+                goto exit;
+            }
+            if (strm.avail_in == 0) break;
+            strm.next_in = reinterpret_cast<Bytef *>(ibuf);
+        }
+        if (ret == Z_STREAM_END) {
+            if (!is_next_member(strm.next_in, strm.avail_in)) {
+                fprintf(stderr, "warning: trailing garbage ignored\n");
+                break;
+            }
+            inflateReset(&strm);
         }
-        if (strm.avail_in == 0) break;
-        strm.next_in = reinterpret_cast<Bytef *>(ibuf);
         do {
             strm.avail_out = SIZE;
             strm.next_out = reinterpret_cast<Bytef *>(obuf);
-// TEMP TEMP: use different name to not confuse gdb
-#ifdef USE_ZLIB
-            ret = inflate(&strm, Z_NO_FLUSH);
-#else
-            ret = PLS_inflate(&strm, Z_NO_FLUSH);
-#endif
+            ret = do_inflate(&strm);
             // NOTE(peter): Z_BUF_ERROR is NOT fatal. It will be called if:
             // "no progress was possible or if there was not enough room in the output
             // buffer when Z_FINISH is used. Note that Z_BUF_ERROR is not fatal, and
@@ -115,10 +669,16 @@ int main(int argc, char **argv) {
                 inflateEnd(&strm);
                 fprintf(stderr, "write error: %s\n", strerror(ret));
             }
-        } while (strm.avail_out == 0);
-    } while (ret != Z_STREAM_END);
+        } while (strm.avail_out == 0 && ret != Z_STREAM_END);
+    }
 
     inflateEnd(&strm);
+    // the input ran out in the middle of a member, before its trailer was checked
+    if (ret != Z_STREAM_END) {
+        ret = Z_BUF_ERROR;
+        fprintf(stderr, "inflate error[%d]: unexpected end of input\n", ret);
+        goto exit;
+    }
     ret = 0;
 
 exit:
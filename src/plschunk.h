@@ -0,0 +1,46 @@
+#pragma once
+
+#include "plszip.h"
+
+#ifndef USE_ZLIB
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Raw deflate blocks decoded from a block boundary in the middle of an
+// in-memory stream, so that one gzip member can be decoded in pieces on
+// several threads. Back-references that reach before the first byte of a
+// piece are kept as markers until the 32K of output before it is known: a
+// symbol below `PLS_Marker` is a byte, `PLS_Marker + i` is byte i of that
+// window.
+static constexpr uint16_t PLS_Marker = 256;
+static constexpr size_t PLS_WindowSize = 32768;
+
+struct PLS_chunk {
+    uint64_t begin; // bit offset of the first block
+    uint64_t end;   // bit offset just past the last block
+    bool final;     // the last block is the final one of the stream
+    std::vector<uint16_t> out;
+};
+
+// Decodes blocks from bit `begin` of the `size` bytes at `data` until the
+// first block that ends at or past bit `stop`, the final block, or the first
+// block that ends with at least `limit` symbols decoded. Only the last
+// `history` bytes of the window may be referenced. Returns Z_OK, or
+// Z_DATA_ERROR with `*msg` set.
+int PLS_decode_chunk(const Bytef *data, size_t size, uint64_t begin, uint64_t stop, size_t limit, size_t history,
+                     PLS_chunk *chunk, const char **msg);
+
+// Looks for the first bit in [from, to) that starts a non-final dynamic
+// huffman block, and from which blocks decode without error until `stop` as
+// by `PLS_decode_chunk` with an unknown window. Returns false if none does,
+// or once `*cancel` is set.
+bool PLS_find_chunk(const Bytef *data, size_t size, uint64_t from, uint64_t to, uint64_t stop, size_t limit,
+                    const std::atomic<bool> *cancel, PLS_chunk *chunk);
+
+// Writes the output of `chunk` to `dst`, taking the markers from `window`,
+// the `wsize` bytes of output before the chunk. Returns false if a marker
+// refers to a byte before the start of `window`.
+bool PLS_resolve_chunk(const PLS_chunk *chunk, const Bytef *window, size_t wsize, Bytef *dst);
+#endif
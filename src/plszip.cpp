@@ -1,12 +1,8 @@
 #include "plszip.h"
-
-// TODO: faster huffman code reading using linked-listed LUT implementation
-// TODO: can I remove the allocation for the dynamic trees?
+#include "plschunk.h"
 
 #ifndef USE_ZLIB
 
-// #define CALC_AND_CHECK_CRC
-
 #include <cassert>
 #include <cstdint>
 #include <cstdio>
@@ -14,6 +10,13 @@
 #include <cstring>
 #include <new>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
 #include "crc32.h"
 #include "inflate_tables.h"
 
@@ -82,9 +85,22 @@ static constexpr size_t DISTANCE_BASES[32] = {
 static constexpr size_t NumHeaderCodeLengths = 19;
 static constexpr size_t order[NumHeaderCodeLengths] = {16, 17, 18, 0, 8,  7, 9,  6, 10, 5,
                                                        11, 4,  12, 3, 13, 2, 14, 1, 15};
-static constexpr size_t HeaderTreeMaxSize = 1u << 7;
 static constexpr size_t MaxDynamicCodeLengths = 322;
 static constexpr size_t MaxCodeBits = 16;
+static constexpr size_t MaxHuffmanCodes = 288;
+
+// Number of bits used to index the root decode tables. Codes longer than
+// this are resolved through a second lookup in a subtable.
+static constexpr size_t HeaderTableBits = 7;
+static constexpr size_t LitTableBits = 9;
+static constexpr size_t DstTableBits = 6;
+
+// Worst case size of a root table plus all of its subtables for 286
+// literal/length codes and 30 distance codes with a maximum code length of 15,
+// as computed by zlib's examples/enough.c.
+static constexpr size_t HeaderTableSize = 1u << HeaderTableBits;
+static constexpr size_t LitTableSize = 852;
+static constexpr size_t DstTableSize = 592;
 
 /* Internal Types */
 enum inflate_mode {
@@ -111,47 +127,80 @@ enum inflate_mode {
     END_BLOCK,
     CHECK_CRC32,
     CHECK_ISIZE,
+    DONE, /* end of the member, until inflateReset */
 };
 typedef enum inflate_mode inflate_mode;
 
+enum table_type {
+    CODES_TABLE,  /* code length alphabet */
+    LITLEN_TABLE, /* literal/length alphabet */
+    DIST_TABLE,   /* distance alphabet */
+};
+typedef enum table_type table_type;
+
+// Decode table entry flags in `huff_entry::op`
+static constexpr uint8_t HuffInvalid = 0x00u;   /* no code maps to these bits */
+static constexpr uint8_t HuffExtraMask = 0x0Fu; /* # of extra bits, or # of subtable index bits */
+static constexpr uint8_t HuffBase = 0x10u;      /* `val` is a length or distance base */
+static constexpr uint8_t HuffSubtable = 0x20u;  /* `val` is the offset of a subtable */
+static constexpr uint8_t HuffEndBlock = 0x40u;  /* end of block code */
+static constexpr uint8_t HuffLiteral = 0x80u;   /* `val` is a literal (or code length) symbol */
+
+// A single lookup resolves the next code to its symbol, the number of bits to
+// drop and how many extra bits follow it.
+struct huff_entry {
+    uint8_t op;   /* entry kind and extra bits, see Huff* flags */
+    uint8_t bits; /* code length, including the root bits for subtable entries */
+    uint16_t val; /* literal, length or distance base, or subtable offset */
+};
+typedef struct huff_entry huff_entry;
+static_assert(sizeof(huff_entry) == 4, "decode table entries should pack into 32 bits");
+
 static_assert(sizeof(uLong) >= 4, "Only support architectures with unsigned long >= 4 bytes");
 
+// The fast decode loop tops up the bit accumulator without checking for the
+// end of the input and writes whole matches without checking for the end of
+// the output, so it only runs while both buffers have room for the worst case:
+// an 8 byte load per refill and a 258 byte match per symbol.
+static constexpr uInt FastMinInput = 8;
+static constexpr uInt FastMinOutput = 258;
+// Room needed past the end of a match for `copyBytes` to finish it with whole
+// 32 byte stores.
+static constexpr size_t CopySlack = 32;
+
 struct internal_state {
     inflate_mode mode;
-    uInt bits;   // # of bits in bit accumulator
-    uLong buff;  // bit accumator
+    uInt bits;      // # of bits in bit accumulator
+    uint64_t buff;  // bit accumator
     gz_header *head;
-    const uint8_t *litlens;
-    const uint16_t *litcodes;
-    const uint8_t *dstlens;
-    const uint16_t *dstcodes;
-    union {
-        uint16_t length;
-        uint16_t lencode;
-    };
+    const huff_entry *litcodes;
+    const huff_entry *dstcodes;
+    uint16_t length;
     union {
         uint16_t index;
-        uint16_t dstcode;
+        uint16_t distance;
         uint16_t n_codes;
     };
     uint16_t hlit;
     uint16_t hdist;
     uint16_t hclen;
-    uint16_t *dynlits;
-    uint16_t *dyndsts;
     uint16_t wnd_mask;
     uint16_t wnd_head;
     uint16_t wnd_size;
-    uint8_t litmaxbits;
-    uint8_t dstmaxbits;
+    uint8_t extra;
     Byte flags;
     Byte blkfinal;
+    Byte validate; /* check the crc of the output against the trailer */
 
 #ifndef NDEBUG
     int block_number;
 #endif
 
-    uint16_t htree[HeaderTreeMaxSize];
+    huff_entry htree[HeaderTableSize];
+    huff_entry fixedlits[1u << LitTableBits];
+    huff_entry fixeddsts[1u << DstTableBits];
+    huff_entry dynlits[LitTableSize];
+    huff_entry dyndsts[DstTableSize];
     uint8_t dynlens[MaxDynamicCodeLengths];
     uint8_t hlengths[NumHeaderCodeLengths];
 
@@ -171,18 +220,12 @@ void zcfree(voidpf opaque, voidpf ptr) {
 
 const char *zlibVersion() { return "pzlib 0.0.1"; }
 
-// avoiding bringing in <algorithm> just for std::max<>
-uint8_t max_u8(uint8_t x, uint8_t y) noexcept { return x > y ? x : y; }
+// avoiding bringing in <algorithm> just for std::min<>
 uint32_t min_u32(uint32_t x, uint32_t y) noexcept { return x < y ? x : y; }
 int32_t min_s32(int32_t x, int32_t y) noexcept { return x < y ? x : y; }
 
-uint8_t max_length(const uint8_t *first, const uint8_t *last) noexcept {
-    uint8_t result = 0;
-    while (first != last) {
-        result = max_u8(*first++, result);
-    }
-    return result;
-}
+static bool build_decode_table(huff_entry *table, size_t rootbits, size_t tablesize, const uint8_t *codelens,
+                               size_t ncodes, table_type type);
 
 int inflateInit2_(z_streamp strm, int windowBits, const char *version, int stream_size) {
     if (strcmp(version, ZLIB_VERSION) != 0) {
@@ -224,47 +267,34 @@ int inflateInit2_(z_streamp strm, int windowBits, const char *version, int strea
         return Z_MEM_ERROR;
     }
     strm->state = new (mem) internal_state{};
-    strm->state->mode = HEADER;
-    strm->state->buff = 0UL;
-    strm->state->bits = 0;
-    strm->state->flags = 0;
-    strm->state->blkfinal = 0;
-#ifndef NDEBUG
-    strm->state->block_number = 0;
-#endif
-    strm->state->litlens = nullptr;
-    strm->state->litcodes = nullptr;
-    strm->state->litmaxbits = 0;
-    strm->state->dstlens = nullptr;
-    strm->state->dstcodes = nullptr;
-    strm->state->dstmaxbits = 0;
-    strm->state->index = 0;
-    strm->state->hlit = 0;
-    strm->state->hdist = 0;
-    strm->state->hclen = 0;
-    strm->state->dynlits = nullptr;
-    strm->state->dyndsts = nullptr;
+    strm->state->validate = 1;
     assert(window_size <= 0xFFFFu);
     strm->state->wnd_mask = static_cast<uint16_t>(window_size - 1);
-    strm->state->wnd_head = 0;
-    strm->state->wnd_size = 0;
-    return Z_OK;
-}
-
-static void windowAddByte(internal_state *s, Bytef x) {
-    if (s->wnd_size <= s->wnd_mask) {
-        s->wnd_size++;
+    inflateReset(strm);
+    if (!build_decode_table(strm->state->fixedlits, LitTableBits, ARRSIZE(strm->state->fixedlits),
+                            fixed_huffman_literals_lens, ARRSIZE(fixed_huffman_literals_lens), LITLEN_TABLE) ||
+        !build_decode_table(strm->state->fixeddsts, DstTableBits, ARRSIZE(strm->state->fixeddsts),
+                            fixed_huffman_distance_lens, ARRSIZE(fixed_huffman_distance_lens), DIST_TABLE)) {
+        strm->msg = "failed to build fixed huffman tables";
+        inflateEnd(strm);
+        return Z_STREAM_ERROR;
     }
-    s->wnd[s->wnd_head] = x;
-    s->wnd_head = static_cast<uint16_t>((s->wnd_head + 1) & s->wnd_mask);
+    return Z_OK;
 }
 
-static void windowAdd(internal_state *s, const Bytef *buf, int n) {
-    assert(n < UINT16_MAX);
+static void windowAdd(internal_state *s, const Bytef *buf, size_t len) {
     int wnd_mask = s->wnd_mask;
     int wnd_capacity = wnd_mask + 1;
     int wnd_head = s->wnd_head;
     int wnd_size = s->wnd_size;
+    if (len > static_cast<size_t>(wnd_capacity)) {
+        // only the most recent `wnd_capacity` bytes can still be referenced
+        size_t skip = len - static_cast<size_t>(wnd_capacity);
+        buf += skip;
+        wnd_head = static_cast<int>((static_cast<size_t>(wnd_head) + skip) & static_cast<size_t>(wnd_mask));
+        len = static_cast<size_t>(wnd_capacity);
+    }
+    int n = static_cast<int>(len);
     int n1 = min_s32(wnd_capacity - wnd_head, n);
     int n2 = n - n1;
     Bytef *p1 = &s->wnd[wnd_head];
@@ -283,22 +313,171 @@ static void windowAdd(internal_state *s, const Bytef *buf, int n) {
     s->wnd_size = static_cast<uint16_t>(wnd_size);
 }
 
-static bool checkDistance(const internal_state *s, size_t distance) {
-    assert(distance <= s->wnd_size);
-    assert(distance <= s->wnd_mask);
-    return distance <= s->wnd_size && distance <= s->wnd_mask;
+// `produced` is the number of bytes written to the output buffer since the
+// window was last updated. Those bytes are referenced straight from the output
+// buffer; anything further back has to come from the window.
+static bool checkDistance(const internal_state *s, size_t distance, size_t produced) {
+    return distance <= produced || distance - produced <= s->wnd_size;
 }
 
-int inflateEnd(z_streamp strm) {
-    if (strm->state) {
-        if (strm->state->dynlits) {
-            strm->zfree(strm->opaque, strm->state->dynlits);
-            strm->state->dynlits = nullptr;
+static inline uint64_t load_u64_le(const Bytef *p) noexcept {
+    uint64_t x;
+    memcpy(&x, p, sizeof(x));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    x = __builtin_bswap64(x);
+#endif
+    return x;
+}
+
+// Copies `length` bytes to `out` from `distance` bytes back, where the source
+// may overlap the bytes being written. When the output buffer, which ends at
+// `limit`, has `CopySlack` bytes to spare past the match, the copy is done in
+// whole 8, 16 or 32 byte chunks and may write up to `CopySlack` bytes past the
+// end of the match. Those bytes get overwritten by whatever is decoded next.
+// Returns the end of the match.
+static inline Bytef *copyBytes(Bytef *out, size_t distance, size_t length, const Bytef *limit) {
+    const Bytef *from = out - distance;
+    Bytef *const stop = out + length;
+    if (static_cast<size_t>(limit - stop) >= CopySlack) {
+#ifdef __AVX2__
+        if (distance >= 32) {
+            do {
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(out),
+                                    _mm256_loadu_si256(reinterpret_cast<const __m256i *>(from)));
+                out += 32;
+                from += 32;
+            } while (out < stop);
+            return stop;
+        }
+#endif
+#ifdef __SSE2__
+        if (distance >= 16) {
+            do {
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(out),
+                                 _mm_loadu_si128(reinterpret_cast<const __m128i *>(from)));
+                out += 16;
+                from += 16;
+            } while (out < stop);
+            return stop;
+        }
+#endif
+        if (distance >= 8) {
+            // chunks of 8 never read bytes they haven't written yet
+            do {
+                memcpy(out, from, 8);
+                out += 8;
+                from += 8;
+            } while (out < stop);
+            return stop;
         }
-        if (strm->state->dyndsts) {
-            strm->zfree(strm->opaque, strm->state->dyndsts);
-            strm->state->dyndsts = nullptr;
+        if ((distance & (distance - 1)) == 0) {
+            // distance 1, 2 or 4: repeat the last `distance` bytes across 8
+            // bytes. Multiplying keeps each byte in its lane, so this doesn't
+            // depend on byte order.
+            uint64_t pattern;
+            if (distance == 1) {
+                pattern = from[0] * UINT64_C(0x0101010101010101);
+            } else if (distance == 2) {
+                uint16_t x;
+                memcpy(&x, from, sizeof(x));
+                pattern = x * UINT64_C(0x0001000100010001);
+            } else {
+                uint32_t x;
+                memcpy(&x, from, sizeof(x));
+                pattern = x * UINT64_C(0x0000000100000001);
+            }
+#ifdef __SSE2__
+            const __m128i v = _mm_set1_epi64x(static_cast<long long>(pattern));
+            do {
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(out), v);
+                out += 16;
+            } while (out < stop);
+#else
+            do {
+                memcpy(out, &pattern, sizeof(pattern));
+                out += sizeof(pattern);
+            } while (out < stop);
+#endif
+            return stop;
         }
+    }
+    if (distance >= length) {
+        memcpy(out, from, length);
+        return stop;
+    }
+    while (out < stop) {
+        *out++ = *from++;
+    }
+    return stop;
+}
+
+// Copies `length` bytes of a match starting `distance` bytes back from `out`.
+// `produced` is the number of bytes before `out` in the output buffer (see
+// `checkDistance`), and `limit` is the end of the output buffer. Returns the
+// new output position.
+static Bytef *copyMatch(const internal_state *s, Bytef *out, size_t produced, size_t distance, size_t length,
+                        const Bytef *limit) {
+    if (distance > produced) {
+        // match starts in the window, which may wrap around
+        size_t wnd_capacity = static_cast<size_t>(s->wnd_mask) + 1;
+        size_t back = distance - produced;
+        size_t index = (s->wnd_head + wnd_capacity - back) & s->wnd_mask;
+        size_t n = length < back ? length : back;
+        size_t n1 = n < wnd_capacity - index ? n : wnd_capacity - index;
+        memcpy(out, &s->wnd[index], n1);
+        memcpy(out + n1, &s->wnd[0], n - n1);
+        out += n;
+        length -= n;
+        if (length == 0) {
+            return out;
+        }
+    }
+    return copyBytes(out, distance, length, limit);
+}
+
+// Gets ready for a new gzip member, keeping the window size and validation
+// setting. Used to decode the members of a multi-member file one by one.
+int inflateReset(z_streamp strm) {
+    if (strm == Z_NULL || strm->state == Z_NULL) {
+        return Z_STREAM_ERROR;
+    }
+    internal_state *state = strm->state;
+    strm->total_in = 0;
+    strm->total_out = 0;
+    strm->adler = 0;
+    strm->msg = Z_NULL;
+    state->mode = HEADER;
+    state->buff = 0UL;
+    state->bits = 0;
+    state->head = Z_NULL;
+    state->flags = 0;
+    state->blkfinal = 0;
+#ifndef NDEBUG
+    state->block_number = 0;
+#endif
+    state->litcodes = nullptr;
+    state->dstcodes = nullptr;
+    state->length = 0;
+    state->extra = 0;
+    state->index = 0;
+    state->hlit = 0;
+    state->hdist = 0;
+    state->hclen = 0;
+    state->wnd_head = 0;
+    state->wnd_size = 0;
+    return Z_OK;
+}
+
+int inflateValidate(z_streamp strm, int check) {
+    if (strm == Z_NULL || strm->state == Z_NULL) {
+        return Z_STREAM_ERROR;
+    }
+    strm->state->validate = check != 0;
+    return Z_OK;
+}
+
+int inflateEnd(z_streamp strm) {
+    if (strm->state) {
         strm->zfree(strm->opaque, strm->state);
     }
     strm->state = Z_NULL;
@@ -317,26 +496,79 @@ int inflateEnd(z_streamp strm) {
 #define CHECK_IO()
 #endif
 
+// Folds the output written since the last update into the running crc. Done
+// at the end of every block and before returning, so each chunk is checked
+// while it is still in cache.
+#define UPDATE_CHECK()                                                                                   \
+    do {                                                                                                 \
+        if (state->validate) {                                                                           \
+            strm->adler = calc_crc32(AS_U32(strm->adler), unchecked, static_cast<size_t>(out - unchecked)); \
+        }                                                                                                \
+        unchecked = out;                                                                                 \
+    } while (0)
+
 #ifndef NDEBUG
-#define NEXTBYTE()                                 \
-    do {                                           \
-        if (avail_in == 0) goto exit;              \
-        avail_in--;                                \
-        buff += static_cast<uLong>(*in++) << bits; \
-        read++;                                    \
-        bits += 8;                                 \
+#define NEXTBYTE()                                    \
+    do {                                              \
+        if (avail_in == 0) goto exit;                 \
+        avail_in--;                                   \
+        buff += static_cast<uint64_t>(*in++) << bits; \
+        read++;                                       \
+        bits += 8;                                    \
     } while (0)
 #else
-#define NEXTBYTE()                                 \
-    do {                                           \
-        if (avail_in == 0) goto exit;              \
-        avail_in--;                                \
-        buff += static_cast<uLong>(*in++) << bits; \
-        bits += 8;                                 \
+#define NEXTBYTE()                                    \
+    do {                                              \
+        if (avail_in == 0) goto exit;                 \
+        avail_in--;                                   \
+        buff += static_cast<uint64_t>(*in++) << bits; \
+        bits += 8;                                    \
+    } while (0)
+#endif
+
+// Top the bit accumulator up to at least 56 bits with a single unaligned 8
+// byte load, keeping only the whole bytes that fit so that the bits above
+// `bits` stay zero. Within the last 8 bytes of input, pull in a single byte.
+#ifndef NDEBUG
+#define PULLBYTES()                                                                            \
+    do {                                                                                       \
+        if (avail_in >= 8) {                                                                   \
+            uInt nbytes_ = (63 - bits) >> 3;                                                   \
+            buff |= (load_u64_le(in) << bits) & ((UINT64_C(1) << (bits + 8 * nbytes_)) - 1); \
+            in += nbytes_;                                                                     \
+            avail_in -= nbytes_;                                                               \
+            read += nbytes_;                                                                   \
+            bits += 8 * nbytes_;                                                               \
+        } else {                                                                               \
+            NEXTBYTE();                                                                        \
+        }                                                                                      \
+    } while (0)
+#else
+#define PULLBYTES()                                                                            \
+    do {                                                                                       \
+        if (avail_in >= 8) {                                                                   \
+            uInt nbytes_ = (63 - bits) >> 3;                                                   \
+            buff |= (load_u64_le(in) << bits) & ((UINT64_C(1) << (bits + 8 * nbytes_)) - 1); \
+            in += nbytes_;                                                                     \
+            avail_in -= nbytes_;                                                               \
+            bits += 8 * nbytes_;                                                               \
+        } else {                                                                               \
+            NEXTBYTE();                                                                        \
+        }                                                                                      \
     } while (0)
 #endif
 
 #define NEEDBITS(n)                     \
+    do {                                \
+        assert((n) < 8 * sizeof(buff)); \
+        while (bits < (n)) PULLBYTES(); \
+    } while (0)
+
+// Like NEEDBITS, but one byte at a time so nothing past the `n` bits is read.
+// The trailer is read this way, which leaves a member's input ending right
+// after it, and whatever follows (another member) in the input. Reading ahead
+// while decoding the blocks is fine: it stays within the 8 byte trailer.
+#define NEEDBITS_EXACT(n)               \
     do {                                \
         assert((n) < 8 * sizeof(buff)); \
         while (bits < (n)) NEXTBYTE();  \
@@ -357,6 +589,22 @@ int inflateEnd(z_streamp strm) {
         bits -= bits & 7;  \
     } while (0)
 
+// Look up the next code in a two-level decode table, pulling in more input
+// until the bit accumulator holds the entire code. Bits above `bits` in the
+// accumulator are always zero, so a lookup on a partial code can only resolve
+// to an entry that is longer than the bits available.
+#define DECODE(e, table, rootbits)                                                                     \
+    do {                                                                                               \
+        for (;;) {                                                                                     \
+            e = (table)[PEEKBITS(rootbits)];                                                           \
+            if ((e.op & HuffSubtable) != 0) {                                                          \
+                e = (table)[e.val + ((buff >> (rootbits)) & ((1u << (e.op & HuffExtraMask)) - 1))];    \
+            }                                                                                          \
+            if (e.bits <= bits) break;                                                                 \
+            PULLBYTES();                                                                               \
+        }                                                                                              \
+    } while (0)
+
 static const unsigned char BitReverseTable256[256] = {
 // clang-format off
 #   define R2(n)     n,     n + 2*64,     n + 1*64,     n + 3*64
@@ -389,76 +637,245 @@ constexpr int calc_min_code_len(uint16_t code) noexcept {
 }
 #endif
 
-static void init_huffman_tree(uint16_t *tree, const size_t maxlen, const uint8_t *codelens, size_t ncodes) {
-    constexpr size_t MAX_HCODE_BIT_LENGTH = 16;
-    constexpr size_t MAX_HUFFMAN_CODES = 512;
-    size_t bl_count[MAX_HCODE_BIT_LENGTH];
-    uint16_t next_code[MAX_HCODE_BIT_LENGTH];
-    uint16_t codes[MAX_HUFFMAN_CODES];
+static huff_entry make_entry(table_type type, size_t sym, size_t codelen) {
+    huff_entry e;
+    e.bits = static_cast<uint8_t>(codelen);
+    e.op = HuffInvalid;
+    e.val = 0;
+    switch (type) {
+    case CODES_TABLE:
+        e.op = HuffLiteral;
+        e.val = static_cast<uint16_t>(sym);
+        break;
+    case LITLEN_TABLE:
+        if (sym < 256) {
+            e.op = HuffLiteral;
+            e.val = static_cast<uint16_t>(sym);
+        } else if (sym == 256) {
+            e.op = HuffEndBlock;
+        } else if (sym <= 285) {
+            e.op = static_cast<uint8_t>(HuffBase | LengthExtraBits[sym - 257]);
+            e.val = static_cast<uint16_t>(LengthBases[sym - 257]);
+        }
+        break;
+    case DIST_TABLE:
+        if (sym < 30) {
+            e.op = static_cast<uint8_t>(HuffBase | DistanceExtraBits[sym]);
+            e.val = static_cast<uint16_t>(DISTANCE_BASES[sym]);
+        }
+        break;
+    }
+    return e;
+}
 
-    assert(ncodes < MAX_HUFFMAN_CODES);
+// Builds a two-level decode table. The root table is indexed by the next
+// `rootbits` bits of input; codes longer than that point to a subtable that is
+// indexed by the bits that follow. Returns false if the code lengths are
+// over-subscribed or incomplete, except that a distance table may have a
+// single code of length 1, or none.
+static bool build_decode_table(huff_entry *table, const size_t rootbits, const size_t tablesize,
+                               const uint8_t *codelens, size_t ncodes, table_type type) {
+    size_t bl_count[MaxCodeBits];
+    size_t remaining[MaxCodeBits];
+    uint16_t next_code[MaxCodeBits];
+    uint16_t offsets[MaxCodeBits];
+    uint16_t sorted[MaxHuffmanCodes];
+
+    assert(ncodes <= MaxHuffmanCodes);
+    assert(rootbits < MaxCodeBits && (1u << rootbits) <= tablesize);
+
+    // 1) Count the number of codes for each code length. Let bl_count[N] be the
+    // number of codes of length N, N >= 1.
+    memset(&bl_count[0], 0, sizeof(bl_count));
+    for (size_t i = 0; i < ncodes; ++i) {
+        assert(codelens[i] < MaxCodeBits);
+        ++bl_count[codelens[i]];
+    }
+    const size_t nsorted = ncodes - bl_count[0];
+    bl_count[0] = 0;
+    size_t maxlen = MaxCodeBits - 1;
+    while (maxlen > 0 && bl_count[maxlen] == 0) {
+        --maxlen;
+    }
 
     {
-        // 1) Count the number of codes for each code length. Let bl_count[N] be the
-        // number of codes of length N, N >= 1.
-        memset(&bl_count[0], 0, sizeof(bl_count));
-        for (size_t i = 0; i < ncodes; ++i) {
-            assert(codelens[i] <= MAX_HCODE_BIT_LENGTH);
-            assert(codelens[i] <= maxlen);
-            ++bl_count[codelens[i]];
+        // Reject over-subscribed codes, and incomplete codes other than the
+        // single code of length 1 (or none) allowed for distances.
+        int left = 1;
+        for (size_t bits = 1; bits < MaxCodeBits; ++bits) {
+            left <<= 1;
+            left -= static_cast<int>(bl_count[bits]);
+            if (left < 0) {
+                return false;
+            }
+        }
+        if (left > 0 && (type != DIST_TABLE || maxlen > 1)) {
+            return false;
         }
-        bl_count[0] = 0;
     }
 
+    // 2) Find the numerical value of the smallest code for each code length,
+    // and sort the symbols by code length so that codes sharing a root prefix
+    // are visited consecutively.
     {
-        // 2) Find the numerical value of the smallest code for each code length:
-        memset(&next_code[0], 0, sizeof(next_code));
         uint16_t code = 0;
-        for (size_t bits = 1; bits <= maxlen; ++bits) {
+        uint16_t offset = 0;
+        next_code[0] = 0;
+        offsets[0] = 0;
+        for (size_t bits = 1; bits < MaxCodeBits; ++bits) {
             code = static_cast<uint16_t>((code + bl_count[bits - 1]) << 1);
             next_code[bits] = code;
+            offsets[bits] = offset;
+            offset = static_cast<uint16_t>(offset + bl_count[bits]);
         }
-    }
-
-    {
-        // 3) Assign numerical values to all codes, using consecutive values for all
-        // codes of the same length with the base values determined at step 2. Codes
-        // that are never used (which have a bit length of zero) must not be
-        // assigned a value.
-        memset(&codes[0], 0, sizeof(codes));
         for (size_t i = 0; i < ncodes; ++i) {
-            if (i == 256) {
-                DEBUG("here");
-            }
             if (codelens[i] != 0) {
-                codes[i] = next_code[codelens[i]]++;
-                assert(calc_min_code_len(codes[i]) <= codelens[i]);
+                sorted[offsets[codelens[i]]++] = static_cast<uint16_t>(i);
             }
         }
+        memcpy(&remaining[0], &bl_count[0], sizeof(remaining));
     }
 
-    {
-        // 4) Generate dense table. This means that can read `max_bit_length` bits at a
-        // time, and do a lookup immediately; should then use `code_lengths` to
-        // determine how many of the peek'd bits should be removed.
-        memset(tree, 0xff, (1u << maxlen) * sizeof(tree[0]));
-        for (size_t i = 0; i < ncodes; ++i) {
-            if (codelens[i] == 0) continue;
-            uint16_t code = codes[i];
-            uint16_t codelen = codelens[i];
-            uint16_t value = static_cast<uint16_t>(i);
-            size_t empty_bits = maxlen - codelen;
-            code = static_cast<uint16_t>(code << empty_bits);
-            uint16_t lowbits = static_cast<uint16_t>((1u << empty_bits) - 1);
-            uint16_t maxcode = code | lowbits;
-            while (code <= maxcode) {
-                uint16_t flipped = flip_code(code, maxlen);
-                assert(tree[flipped] == 0xffffu);
-                tree[flipped] = value;
-                ++code;
+    // 3) Fill the root table, replicating each short code into every slot whose
+    // low bits match it, and allocate subtables for the long codes.
+    const size_t rootsize = 1u << rootbits;
+    const huff_entry invalid = {HuffInvalid, static_cast<uint8_t>(rootbits), 0};
+    for (size_t i = 0; i < rootsize; ++i) {
+        table[i] = invalid;
+    }
+
+    size_t next = rootsize;    // next free table slot for a subtable
+    size_t prefix = SIZE_MAX;  // root bits of the current subtable
+    size_t subbase = 0;
+    size_t subbits = 0;
+    for (size_t k = 0; k < nsorted; ++k) {
+        const uint16_t sym = sorted[k];
+        const size_t codelen = codelens[sym];
+        const uint16_t code = next_code[codelen]++;
+        assert(calc_min_code_len(code) <= static_cast<int>(codelen));
+        const huff_entry e = make_entry(type, sym, codelen);
+        if (codelen <= rootbits) {
+            for (size_t i = flip_code(code, codelen); i < rootsize; i += 1u << codelen) {
+                table[i] = e;
+            }
+        } else {
+            const size_t dropped = codelen - rootbits;
+            if (static_cast<size_t>(code >> dropped) != prefix) {
+                prefix = code >> dropped;
+                subbits = dropped;
+                int left = 1 << subbits;
+                while (subbits + rootbits < maxlen) {
+                    left -= static_cast<int>(remaining[subbits + rootbits]);
+                    if (left <= 0) break;
+                    ++subbits;
+                    left <<= 1;
+                }
+                subbase = next;
+                next += 1u << subbits;
+                if (next > tablesize) {
+                    return false;
+                }
+                const huff_entry subinvalid = {HuffInvalid, static_cast<uint8_t>(rootbits + subbits), 0};
+                for (size_t i = subbase; i < next; ++i) {
+                    table[i] = subinvalid;
+                }
+                huff_entry &link = table[flip_code(static_cast<uint16_t>(prefix), rootbits)];
+                link.op = static_cast<uint8_t>(HuffSubtable | subbits);
+                link.bits = static_cast<uint8_t>(rootbits);
+                link.val = static_cast<uint16_t>(subbase);
+            }
+            const uint16_t low = static_cast<uint16_t>(code & ((1u << dropped) - 1));
+            for (size_t i = flip_code(low, dropped); i < (1u << subbits); i += 1u << dropped) {
+                table[subbase + i] = e;
             }
         }
+        --remaining[codelen];
     }
+    return true;
+}
+
+// Decodes literal/length and distance codes of the current block without
+// saving any state between symbols. Only called from HUFFMAN_READ while there
+// are at least `FastMinInput` bytes of input and `FastMinOutput` bytes of
+// output left. Hands back to the state machine once either buffer gets close
+// to its end, or on an end of block or invalid literal/length code, leaving
+// that code in the bit accumulator. `beg` is the start of the output buffer
+// passed to this call of `inflate`; the window holds everything before it.
+// Returns an error message for an invalid distance, or nullptr.
+static const char *inflate_fast(internal_state *state, z_const Bytef **next_in, uInt *avail_in, const Bytef *beg,
+                                Bytef **next_out, uInt *avail_out, uint64_t *bitbuf, uInt *bitcnt) {
+    assert(*avail_in >= FastMinInput && *avail_out >= FastMinOutput);
+    z_const Bytef *in = *next_in;
+    z_const Bytef *const last = in + (*avail_in - (FastMinInput - 1));
+    Bytef *out = *next_out;
+    Bytef *const start = out;
+    Bytef *const end = out + (*avail_out - (FastMinOutput - 1));
+    const Bytef *const limit = out + *avail_out;
+    uint64_t buff = *bitbuf;
+    uInt bits = *bitcnt;
+    const huff_entry *const lcode = state->litcodes;
+    const huff_entry *const dcode = state->dstcodes;
+    const char *msg = nullptr;
+    huff_entry here;
+
+    do {
+        // 56 bits covers the longest literal/length code, its extra bits,
+        // and the longest distance code with its extra bits. Bits past
+        // `bits` may be left over from the previous load, but they always
+        // hold the same input bytes, so OR-ing the next load over them is
+        // harmless.
+        buff |= load_u64_le(in) << bits;
+        in += (63 - bits) >> 3;
+        bits |= 56;
+
+        here = lcode[PEEKBITS(LitTableBits)];
+        if ((here.op & HuffSubtable) != 0) {
+            here = lcode[here.val + ((buff >> LitTableBits) & ((1u << (here.op & HuffExtraMask)) - 1))];
+        }
+        if ((here.op & HuffLiteral) != 0) {
+            DROPBITS(here.bits);
+            *out++ = static_cast<Bytef>(here.val);
+            continue;
+        }
+        if ((here.op & HuffBase) == 0) {
+            // end of block or invalid code, let the state machine handle it
+            break;
+        }
+        DROPBITS(here.bits);
+        uInt extra = here.op & HuffExtraMask;
+        size_t length = here.val + PEEKBITS(extra);
+        DROPBITS(extra);
+
+        here = dcode[PEEKBITS(DstTableBits)];
+        if ((here.op & HuffSubtable) != 0) {
+            here = dcode[here.val + ((buff >> DstTableBits) & ((1u << (here.op & HuffExtraMask)) - 1))];
+        }
+        if ((here.op & HuffBase) == 0) {
+            msg = "invalid distance code";
+            break;
+        }
+        DROPBITS(here.bits);
+        extra = here.op & HuffExtraMask;
+        size_t distance = here.val + PEEKBITS(extra);
+        DROPBITS(extra);
+
+        size_t produced = static_cast<size_t>(out - beg);
+        if (!checkDistance(state, distance, produced)) {
+            msg = "invalid distance too far back";
+            break;
+        }
+        out = copyMatch(state, out, produced, distance, length, limit);
+    } while (in < last && out < end);
+
+    // the state machine expects every bit above `bits` to be zero
+    buff &= (UINT64_C(1) << bits) - 1;
+    *avail_in -= static_cast<uInt>(in - *next_in);
+    *avail_out -= static_cast<uInt>(out - start);
+    *next_in = in;
+    *next_out = out;
+    *bitbuf = buff;
+    *bitcnt = bits;
+    return msg;
 }
 
 int inflate(z_streamp strm, int flush) { return PLS_inflate(strm, flush); }
@@ -477,8 +894,9 @@ int PLS_inflate(z_streamp strm, int flush) {
     uInt avail_in = strm->avail_in;
     Bytef *out = strm->next_out;
     uInt avail_out = strm->avail_out;
+    const Bytef *unchecked = out;
     uInt bits = state->bits;
-    uLong buff = state->buff;
+    uint64_t buff = state->buff;
 
 #ifndef NDEBUG
     uLong read = 0;
@@ -488,6 +906,7 @@ int PLS_inflate(z_streamp strm, int flush) {
     uint8_t id1, id2, cm, blktype;
     uint32_t mtime;
     uint16_t value;
+    huff_entry here;
     uInt extra;
 
     if (in == Z_NULL || out == Z_NULL) {
@@ -657,7 +1076,7 @@ int PLS_inflate(z_streamp strm, int flush) {
     case NO_COMPRESSION:
         DROPREMBYTE();
         NEEDBITS(32);
-        if ((buff & 0xFFFFu) != ((buff >> 16) ^ 0xFFFFu)) {
+        if ((buff & 0xFFFFu) != (((buff >> 16) & 0xFFFFu) ^ 0xFFFFu)) {
             panic0(Z_STREAM_ERROR, "invalid stored block lengths");
         }
         state->length = AS_U16(buff);
@@ -671,10 +1090,8 @@ int PLS_inflate(z_streamp strm, int flush) {
         // should be on a byte boundary at this point after flush to
         // byte boundary followed by 2 x 2B reads
 
-        // REVISIT(peter): are there ever bytes
-        // remaining in the buffer?
-
-        // Step 1. Flush remaining bytes in bit buffer to output
+        // Step 1. Flush remaining bytes in bit buffer to output. The fast
+        // decode loop reads ahead, so there may be several.
         assert(bits % 8 == 0);
         uInt length = state->length;
         uInt bytes = bits / 8;
@@ -682,23 +1099,19 @@ int PLS_inflate(z_streamp strm, int flush) {
         length -= amount;
         avail_out -= amount;
 #ifndef NDEBUG
-        read -= amount;
         wrote += amount;
 #endif
         while (amount-- > 0) {
             assert(bits >= 8);
             Bytef c = static_cast<Bytef>(PEEKBITS(8));
             *out++ = c;
-            windowAddByte(state, c);
             DROPBITS(8);
         }
-        assert(bits == 0);
-        assert(buff == 0);
+        assert(bits == 0 || length == 0 || avail_out == 0);
 
         // Step 2. Stream directly from input to output
         amount = min_u32(length, min_u32(avail_in, avail_out));
         memcpy(out, in, amount);
-        windowAdd(state, in, static_cast<int>(amount));
         in += amount;
         out += amount;
         length -= amount;
@@ -720,14 +1133,8 @@ int PLS_inflate(z_streamp strm, int flush) {
     }
     fixed_huffman_block:
     case FIXED_HUFFMAN:
-        state->litlens = fixed_huffman_literals_lens;
-        state->litcodes = fixed_huffman_literals_codes;
-        state->litmaxbits = fixed_huffman_literals_maxbits;
-        state->dstlens = fixed_huffman_distance_lens;
-        state->dstcodes = fixed_huffman_distance_codes;
-        state->dstmaxbits = fixed_huffman_distance_maxbits;
-        assert(state->litmaxbits <= MaxCodeBits);
-        assert(state->dstmaxbits <= MaxCodeBits);
+        state->litcodes = state->fixedlits;
+        state->dstcodes = state->fixeddsts;
         mode = HUFFMAN_READ;
         goto huffman_read;
         break;
@@ -761,7 +1168,10 @@ int PLS_inflate(z_streamp strm, int flush) {
             state->hlengths[order[state->n_codes++]] = static_cast<uint8_t>(PEEKBITS(3));
             DROPBITS(3);
         }
-        init_huffman_tree(state->htree, 7, state->hlengths, NumHeaderCodeLengths);
+        if (!build_decode_table(state->htree, HeaderTableBits, HeaderTableSize, state->hlengths, NumHeaderCodeLengths,
+                                CODES_TABLE)) {
+            panic0(Z_STREAM_ERROR, "invalid code lengths set");
+        }
         memset(state->dynlens, 0, sizeof(state->dynlens));
         state->n_codes = 0;
         mode = DYNAMIC_CODE_LENGTHS;
@@ -770,12 +1180,13 @@ int PLS_inflate(z_streamp strm, int flush) {
     case DYNAMIC_CODE_LENGTHS:
         while (static_cast<int>(state->n_codes) < state->hlit + state->hdist) {
             NEEDBITS(7 + MaxCodeBits);
-            value = state->htree[PEEKBITS(7)];
-            if (value == 0xffffu) {
+            here = state->htree[PEEKBITS(HeaderTableBits)];
+            if (here.op == HuffInvalid) {
                 panic(Z_STREAM_ERROR, "invalid bit sequence in header tree", "invalid bit sequence: 0x%x len=7",
-                      static_cast<Bytef>(PEEKBITS(7)));
+                      static_cast<Bytef>(PEEKBITS(HeaderTableBits)));
             }
-            DROPBITS(state->hlengths[value]);
+            DROPBITS(here.bits);
+            value = here.val;
             uInt nbits, offset;
             uint8_t rvalue;
             if (value <= 15) {
@@ -806,9 +1217,13 @@ int PLS_inflate(z_streamp strm, int flush) {
                 }
                 assert(bits >= nbits);
                 // NEEDBITS(nbits);
-                uLong repeat = PEEKBITS(nbits);
+                uint64_t repeat = PEEKBITS(nbits);
                 DROPBITS(nbits);
                 repeat += offset;
+                if (repeat > static_cast<uint64_t>(state->hlit + state->hdist - state->n_codes)) {
+                    panic(Z_STREAM_ERROR, "too many code lengths", "too many code lengths: hlit=%u hdist=%u read=%u",
+                          state->hlit, state->hdist, state->n_codes);
+                }
                 while (repeat-- > 0) {
                     state->dynlens[state->n_codes++] = rvalue;
                 }
@@ -822,28 +1237,17 @@ int PLS_inflate(z_streamp strm, int flush) {
         }
 
         {
-            // TODO(peter): do this during reading?
-            state->litlens = &state->dynlens[0];
-            state->dstlens = &state->dynlens[state->hlit];
-            state->litmaxbits = max_length(&state->litlens[0], &state->litlens[state->hlit]);
-            state->dstmaxbits = max_length(&state->dstlens[0], &state->dstlens[state->hdist]);
-            assert(state->litmaxbits <= MaxCodeBits);
-            assert(state->dstmaxbits <= MaxCodeBits);
-            if (state->dynlits) {
-                assert(state->dynlits && state->dyndsts);
-                strm->zfree(strm->opaque, state->dynlits);
-                strm->zfree(strm->opaque, state->dyndsts);
+            if (state->dynlens[256] == 0) {
+                panic0(Z_STREAM_ERROR, "missing end-of-block code");
+            }
+            if (!build_decode_table(state->dynlits, LitTableBits, LitTableSize, &state->dynlens[0], state->hlit,
+                                    LITLEN_TABLE)) {
+                panic0(Z_STREAM_ERROR, "invalid literal/lengths set");
             }
-            uInt nlits = 1u << state->litmaxbits;
-            uInt ndsts = 1u << state->dstmaxbits;
-            state->dynlits = reinterpret_cast<uint16_t *>(strm->zalloc(strm->opaque, sizeof(uint16_t), nlits));
-            state->dyndsts = reinterpret_cast<uint16_t *>(strm->zalloc(strm->opaque, sizeof(uint16_t), ndsts));
-            if (!state->dynlits || !state->dyndsts) {
-                panic0(Z_MEM_ERROR, "unable to allocate space for huffman tables");
+            if (!build_decode_table(state->dyndsts, DstTableBits, DstTableSize, &state->dynlens[state->hlit],
+                                    state->hdist, DIST_TABLE)) {
+                panic0(Z_STREAM_ERROR, "invalid distances set");
             }
-            init_huffman_tree(state->dynlits, state->litmaxbits, state->litlens, state->hlit);
-            init_huffman_tree(state->dyndsts, state->dstmaxbits, state->dstlens, state->hdist);
-            // TODO(peter): can save 2 pointers (at the cost of const safety) by just using `lits` and `dsts` directly
             state->litcodes = state->dynlits;
             state->dstcodes = state->dyndsts;
             mode = HUFFMAN_READ;
@@ -852,22 +1256,30 @@ int PLS_inflate(z_streamp strm, int flush) {
         }
     huffman_read:
     case HUFFMAN_READ:
-        NEEDBITS(state->litmaxbits);
-        value = state->litcodes[PEEKBITS(state->litmaxbits)];
-        if (value == 0xffffu) {
-            panic(Z_STREAM_ERROR, "invalid huffman code", "invalid bit sequence: 0x%04lx length=%u",
-                  PEEKBITS(state->litmaxbits), state->litmaxbits);
+        if (avail_in >= FastMinInput && avail_out >= FastMinOutput) {
+#ifndef NDEBUG
+            uInt fast_avail_in = avail_in;
+            uInt fast_avail_out = avail_out;
+#endif
+            const char *fast_msg = inflate_fast(state, &in, &avail_in, strm->next_out, &out, &avail_out, &buff, &bits);
+#ifndef NDEBUG
+            read += fast_avail_in - avail_in;
+            wrote += fast_avail_out - avail_out;
+#endif
+            CHECK_IO();
+            if (fast_msg) {
+                panic0(Z_STREAM_ERROR, fast_msg);
+            }
         }
-        DEBUG("HUFFMAN_READ: %u", value); // TEMP TEMP TEMP
-        if (value < 256) {
+        DECODE(here, state->litcodes, LitTableBits);
+        DEBUG("HUFFMAN_READ: op=0x%02x val=%u", here.op, here.val); // TEMP TEMP TEMP
+        if ((here.op & HuffLiteral) != 0) {
             if (avail_out == 0) {
                 goto exit;
             }
-            DROPBITS(state->litlens[value]);
+            DROPBITS(here.bits);
             assert(avail_out > 0);
-            Bytef c = static_cast<Bytef>(value);
-            windowAddByte(state, c);
-            *out++ = c;
+            *out++ = static_cast<Bytef>(here.val);
             avail_out--;
 #ifndef NDEBUG
             wrote++;
@@ -875,38 +1287,29 @@ int PLS_inflate(z_streamp strm, int flush) {
             CHECK_IO();
             assert(mode == HUFFMAN_READ);
             goto huffman_read;
-        } else if (value == 256) {
-            DROPBITS(state->litlens[value]);
+        } else if ((here.op & HuffEndBlock) != 0) {
+            DROPBITS(here.bits);
             DEBUG0("inflate: end of fixed huffman block found");
-            if (state->litcodes != &fixed_huffman_literals_codes[0]) {
-                assert(state->litcodes == state->dynlits);
-                assert(state->dstcodes == state->dyndsts);
-                strm->zfree(strm->opaque, state->dynlits);
-                strm->zfree(strm->opaque, state->dyndsts);
-                state->dynlits = nullptr;
-                state->dyndsts = nullptr;
-            }
             mode = END_BLOCK;
             goto end_block;
-        } else if (value <= 285) {
-            DROPBITS(state->litlens[value]);
-            assert(257 <= value && value <= 285);
-            state->lencode = static_cast<uint16_t>(value - 257);
-            DEBUG("HUFFMAN_READ state->lencode=%u", state->lencode); // TEMP TEMP TEMP
-            assert(state->lencode < ARRSIZE(LengthBases));
-            assert(state->lencode < ARRSIZE(LengthExtraBits));
+        } else if ((here.op & HuffBase) != 0) {
+            DROPBITS(here.bits);
+            state->length = here.val;
+            state->extra = static_cast<uint8_t>(here.op & HuffExtraMask);
+            DEBUG("HUFFMAN_READ state->length=%u extra=%u", state->length, state->extra); // TEMP TEMP TEMP
             mode = HUFFMAN_LENGTH_CODE;
             goto huffman_length_code;
         } else {
-            panic(Z_STREAM_ERROR, "invalid huffman code", "invalid huffman value: %u", value);
+            panic(Z_STREAM_ERROR, "invalid huffman code", "invalid bit sequence: 0x%04lx length=%u",
+                  PEEKBITS(here.bits), here.bits);
         }
         UNREACHABLE();
         break;
     huffman_length_code:
     case HUFFMAN_LENGTH_CODE:
-        extra = LengthExtraBits[state->lencode];
+        extra = state->extra;
         NEEDBITS(extra);
-        state->length = static_cast<uint16_t>(LengthBases[state->lencode] + PEEKBITS(extra));
+        state->length = static_cast<uint16_t>(state->length + PEEKBITS(extra));
         DEBUG("HUFFMAN_LENGTH_CODE extra=%u state->length=%u", extra, state->length); // TEMP TEMP TEMP
         DROPBITS(extra);
         mode = READ_HUFFMAN_DISTANCE_CODE;
@@ -914,55 +1317,55 @@ int PLS_inflate(z_streamp strm, int flush) {
         break;
     read_huffman_distance_code:
     case READ_HUFFMAN_DISTANCE_CODE:
-        NEEDBITS(state->dstmaxbits);
-        value = state->dstcodes[PEEKBITS(state->dstmaxbits)];
-        if (value == 0xffffu) {
-            panic(Z_STREAM_ERROR, "invalid huffman code", "invalid bit sequence: 0x%04lx length=%u",
-                  PEEKBITS(state->dstmaxbits), state->dstmaxbits);
+        DECODE(here, state->dstcodes, DstTableBits);
+        if ((here.op & HuffBase) == 0) {
+            panic(Z_STREAM_ERROR, "invalid distance code", "invalid bit sequence: 0x%04lx length=%u",
+                  PEEKBITS(here.bits), here.bits);
         }
-        DROPBITS(state->dstlens[value]);
-        if (value >= 32) {
-            panic(Z_STREAM_ERROR, "invalid distance code", "invalid distance code: %u", value);
-        }
-        state->dstcode = value;
-        DEBUG("READ_HUFFMAN_DISTANCE_CODE state->dstcode: %u", state->dstcode); // TEMP TEMP TEMP
+        DROPBITS(here.bits);
+        state->distance = here.val;
+        state->extra = static_cast<uint8_t>(here.op & HuffExtraMask);
+        DEBUG("READ_HUFFMAN_DISTANCE_CODE state->distance: %u", state->distance); // TEMP TEMP TEMP
         mode = HUFFMAN_DISTANCE_CODE;
         goto huffman_distance_code;
         break;
     huffman_distance_code:
     case HUFFMAN_DISTANCE_CODE: {
-        extra = DistanceExtraBits[state->dstcode];
+        extra = state->extra;
         NEEDBITS(extra);
-        size_t distance = DISTANCE_BASES[state->dstcode] + PEEKBITS(extra);
+        size_t distance = state->distance + PEEKBITS(extra);
         DROPBITS(extra);
         DEBUG("HUFFMAN_DISTANCE_CODE extra=%u distance=%zu", extra, distance); // TEMP TEMP TEMP
-        if (!checkDistance(state, distance)) {
+        if (!checkDistance(state, distance, static_cast<size_t>(out - strm->next_out))) {
             panic(Z_STREAM_ERROR, "invalid distance", "invalid distance %zu", distance);
         }
-        size_t wnd_buff_size = static_cast<size_t>(state->wnd_mask + 1);
-        assert(distance < UINT16_MAX);
-        assert(distance < wnd_buff_size);
-        state->index = static_cast<uint16_t>(state->wnd_head + (wnd_buff_size - distance));
+        assert(distance <= UINT16_MAX);
+        state->distance = static_cast<uint16_t>(distance);
         mode = WRITE_HUFFMAN_LEN_DIST;
         goto write_huffman_len_dist;
         break;
     }
     write_huffman_len_dist:
     case WRITE_HUFFMAN_LEN_DIST:
-        while (state->length > 0) {
+        if (state->length > 0) {
             if (avail_out == 0) {
                 goto exit;
             }
-            Bytef c = state->wnd[state->index & state->wnd_mask];
-            *out++ = c;
-            avail_out--;
+            // the distance was checked against the window and output of the
+            // call that decoded it, and the window has caught up with that
+            // output if the copy got split across calls
+            uInt amount = min_u32(state->length, avail_out);
+            out = copyMatch(state, out, static_cast<size_t>(out - strm->next_out), state->distance, amount,
+                            out + avail_out);
+            avail_out -= amount;
 #ifndef NDEBUG
-            wrote++;
+            wrote += amount;
 #endif
-            windowAddByte(state, c);
             CHECK_IO();
-            state->index++;
-            state->length--;
+            state->length = static_cast<uint16_t>(state->length - amount);
+            if (state->length > 0) {
+                goto exit;
+            }
         }
         mode = HUFFMAN_READ;
         goto huffman_read;
@@ -970,6 +1373,7 @@ int PLS_inflate(z_streamp strm, int flush) {
     end_block:
     case END_BLOCK:
         CHECK_IO();
+        UPDATE_CHECK();
         if (state->blkfinal) {
             mode = CHECK_CRC32;
             goto check_crc32;
@@ -981,52 +1385,41 @@ int PLS_inflate(z_streamp strm, int flush) {
     case CHECK_CRC32: {
         CHECK_IO();
         DROPREMBYTE();
-        NEEDBITS(32);
-#ifndef NDEBUG
-        assert(wrote == strm->avail_out - avail_out);
-#endif
-
-#ifdef CALC_AND_CHECK_CRC
-        strm->adler = calc_crc32(static_cast<uint32_t>(strm->adler), strm->next_out, strm->avail_out - avail_out);
-#endif
-        strm->total_out += strm->avail_out - avail_out;
-        strm->avail_out = avail_out;
-#ifndef NDEBUG
-        wrote = 0;
-#endif
-
-#ifdef CALC_AND_CHECK_CRC
+        NEEDBITS_EXACT(32);
         uint32_t crc = AS_U32(buff);
-#endif
         DROPBITS(32);
-#ifdef CALC_AND_CHECK_CRC
-        if (crc != AS_U32(strm->adler)) {
+        if (state->validate && crc != AS_U32(strm->adler)) {
             panic(Z_STREAM_ERROR, "crc check failed", "invalid crc: found=0x%04x expected=0x%04x", crc,
                   AS_U32(strm->adler));
         }
         DEBUG("CRC32: 0x%08x MINE: 0x%08x", crc, AS_U32(strm->adler));
-#endif
         mode = CHECK_ISIZE;
         goto check_isize;
         break;
     }
     check_isize:
     case CHECK_ISIZE: {
-        NEEDBITS(32);
+        NEEDBITS_EXACT(32);
         uint32_t isize = AS_U32(buff);
         DROPBITS(32);
-        DEBUG("Original input size: %u found=%u", isize, AS_U32(strm->total_out));
-        assert(avail_in == 0);
-        if (isize != AS_U32(strm->total_out)) {
-            fprintf(stderr, "%u != %u\n", isize, AS_U32(strm->total_out));
+        uLong total_out = strm->total_out + static_cast<uLong>(out - strm->next_out);
+        DEBUG("Original input size: %u found=%u", isize, AS_U32(total_out));
+        assert(bits == 0);
+        if (isize != AS_U32(total_out)) {
+            fprintf(stderr, "%u != %u\n", isize, AS_U32(total_out));
             panic(Z_STREAM_ERROR, "original size does not match inflated size",
-                  "original size does not match inflated size: orig=%u new=%u", isize, AS_U32(strm->total_out));
+                  "original size does not match inflated size: orig=%u new=%u", isize, AS_U32(total_out));
         }
+        mode = DONE;
+        goto done;
+        break;
+    }
+    done:
+    case DONE:
         ret = Z_STREAM_END;
         goto exit;
         break;
     }
-    }
 
 exit:
     assert(avail_in <= strm->avail_in);
@@ -1035,9 +1428,9 @@ exit:
     assert(read == strm->avail_in - avail_in);
     assert(wrote == strm->avail_out - avail_out);
 #endif
-#ifdef CALC_AND_CHECK_CRC
-    strm->adler = calc_crc32(static_cast<uint32_t>(strm->adler), strm->next_out, strm->avail_out - avail_out);
-#endif
+    UPDATE_CHECK();
+    // the window only needs to be up to date between calls
+    windowAdd(state, strm->next_out, strm->avail_out - avail_out);
     strm->total_in += strm->avail_in - avail_in;
     strm->total_out += strm->avail_out - avail_out;
     strm->next_in = in;
@@ -1050,4 +1443,373 @@ exit:
     return ret;
 }
 
+/* Decoding pieces of an in-memory stream, see plschunk.h */
+
+// Reads bits from an in-memory deflate stream starting at any bit offset.
+// Bits past the end of the input read as zero.
+struct bit_reader {
+    const Bytef *data;
+    size_t size;
+    size_t next;   // next byte of `data` to load into `buff`
+    uint64_t buff; // bit accumulator, bits above `bits` are zero or hold the bytes that follow
+    uInt bits;
+};
+
+// Tops the accumulator up to at least 56 bits, enough for a length and a
+// distance with their extra bits. Returns false once it runs more than 8
+// bytes past the end of the input, which no valid stream does.
+static inline bool br_refill(bit_reader *br) {
+    if (br->next + 8 <= br->size) {
+        br->buff |= load_u64_le(br->data + br->next) << br->bits;
+        br->next += (63 - br->bits) >> 3;
+        br->bits |= 56;
+        return true;
+    }
+    while (br->bits < 56) {
+        if (br->next >= br->size + 8) {
+            return false;
+        }
+        if (br->next < br->size) {
+            br->buff |= static_cast<uint64_t>(br->data[br->next]) << br->bits;
+        }
+        br->next++;
+        br->bits += 8;
+    }
+    return true;
+}
+
+static inline uint64_t br_peek(const bit_reader *br, uInt n) { return br->buff & ((UINT64_C(1) << n) - 1); }
+
+static inline void br_drop(bit_reader *br, uInt n) {
+    assert(br->bits >= n);
+    br->buff >>= n;
+    br->bits -= n;
+}
+
+static inline uint64_t br_tell(const bit_reader *br) { return br->next * 8 - br->bits; }
+
+static void br_seek(bit_reader *br, uint64_t pos) {
+    br->next = pos / 8;
+    br->buff = 0;
+    br->bits = 0;
+    br_refill(br);
+    br_drop(br, static_cast<uInt>(pos % 8));
+}
+
+static inline huff_entry br_decode(const bit_reader *br, const huff_entry *table, size_t rootbits) {
+    huff_entry e = table[br_peek(br, static_cast<uInt>(rootbits))];
+    if ((e.op & HuffSubtable) != 0) {
+        e = table[e.val + ((br->buff >> rootbits) & ((1u << (e.op & HuffExtraMask)) - 1))];
+    }
+    return e;
+}
+
+struct fixed_tables {
+    huff_entry lits[1u << LitTableBits];
+    huff_entry dsts[1u << DstTableBits];
+};
+
+static fixed_tables build_fixed_tables() {
+    fixed_tables t;
+    bool ok = build_decode_table(t.lits, LitTableBits, ARRSIZE(t.lits), fixed_huffman_literals_lens,
+                                 ARRSIZE(fixed_huffman_literals_lens), LITLEN_TABLE) &&
+              build_decode_table(t.dsts, DstTableBits, ARRSIZE(t.dsts), fixed_huffman_distance_lens,
+                                 ARRSIZE(fixed_huffman_distance_lens), DIST_TABLE);
+    assert(ok);
+    (void)ok;
+    return t;
+}
+
+static const fixed_tables &get_fixed_tables() {
+    static const fixed_tables tables = build_fixed_tables();
+    return tables;
+}
+
+// Reads the header of a dynamic huffman block that follows the 3 bit block
+// header, same as the DYNAMIC_HUFFMAN, HEADER_TREE and DYNAMIC_CODE_LENGTHS
+// states, but checks every count since it also runs on random bits while
+// looking for a block. Returns an error message, or nullptr.
+static const char *read_dynamic_header(bit_reader *br, huff_entry *lits, huff_entry *dsts) {
+    huff_entry htree[HeaderTableSize];
+    uint8_t hlengths[NumHeaderCodeLengths];
+    uint8_t lens[MaxDynamicCodeLengths];
+
+    if (!br_refill(br)) {
+        return "unexpected end of input";
+    }
+    const size_t hlit = br_peek(br, 5) + 257;
+    br_drop(br, 5);
+    const size_t hdist = br_peek(br, 5) + 1;
+    br_drop(br, 5);
+    const size_t hclen = br_peek(br, 4) + 4;
+    br_drop(br, 4);
+    if (!(hlit <= 286)) {
+        return "invalid HLIT";
+    }
+    if (!(hdist <= 30)) {
+        return "invalid HDIST";
+    }
+    memset(hlengths, 0, sizeof(hlengths));
+    for (size_t i = 0; i < hclen; ++i) {
+        if (br->bits < 3 && !br_refill(br)) {
+            return "unexpected end of input";
+        }
+        hlengths[order[i]] = static_cast<uint8_t>(br_peek(br, 3));
+        br_drop(br, 3);
+    }
+    if (!build_decode_table(htree, HeaderTableBits, HeaderTableSize, hlengths, NumHeaderCodeLengths, CODES_TABLE)) {
+        return "invalid code lengths set";
+    }
+
+    const size_t total = hlit + hdist;
+    size_t n = 0;
+    while (n < total) {
+        if (!br_refill(br)) {
+            return "unexpected end of input";
+        }
+        const huff_entry e = htree[br_peek(br, HeaderTableBits)];
+        if (e.op == HuffInvalid) {
+            return "invalid bit sequence in header tree";
+        }
+        br_drop(br, e.bits);
+        if (e.val <= 15) {
+            lens[n++] = static_cast<uint8_t>(e.val);
+            continue;
+        }
+        size_t repeat;
+        uint8_t rvalue = 0;
+        if (e.val == 16) {
+            if (n == 0) {
+                return "invalid repeat code";
+            }
+            rvalue = lens[n - 1];
+            repeat = 3 + br_peek(br, 2);
+            br_drop(br, 2);
+        } else if (e.val == 17) {
+            repeat = 3 + br_peek(br, 3);
+            br_drop(br, 3);
+        } else {
+            repeat = 11 + br_peek(br, 7);
+            br_drop(br, 7);
+        }
+        if (repeat > total - n) {
+            return "too many code lengths";
+        }
+        memset(&lens[n], rvalue, repeat);
+        n += repeat;
+    }
+    if (lens[256] == 0) {
+        return "missing end-of-block code";
+    }
+    if (!build_decode_table(lits, LitTableBits, LitTableSize, &lens[0], hlit, LITLEN_TABLE)) {
+        return "invalid literal/lengths set";
+    }
+    if (!build_decode_table(dsts, DstTableBits, DstTableSize, &lens[hlit], hdist, DIST_TABLE)) {
+        return "invalid distances set";
+    }
+    return nullptr;
+}
+
+// Decodes the symbols of one huffman block into `chunk->out` from `*n` on,
+// growing it as needed. Returns an error message, or nullptr.
+static const char *decode_huffman_block(bit_reader *br, const huff_entry *lcode, const huff_entry *dcode,
+                                        size_t history, PLS_chunk *chunk, size_t *n_) {
+    std::vector<uint16_t> &out = chunk->out;
+    uint16_t *o = out.data();
+    size_t n = *n_;
+    const char *msg = nullptr;
+    for (;;) {
+        if (out.size() - n < 258) {
+            out.resize(out.size() < (1u << 16) ? (1u << 16) : 2 * out.size());
+            o = out.data();
+        }
+        if (!br_refill(br)) {
+            msg = "unexpected end of input";
+            break;
+        }
+        huff_entry here = br_decode(br, lcode, LitTableBits);
+        if ((here.op & HuffLiteral) != 0) {
+            br_drop(br, here.bits);
+            o[n++] = here.val;
+            continue;
+        }
+        if ((here.op & HuffBase) == 0) {
+            if ((here.op & HuffEndBlock) != 0) {
+                br_drop(br, here.bits);
+            } else {
+                msg = "invalid literal/length code";
+            }
+            break;
+        }
+        br_drop(br, here.bits);
+        uInt extra = here.op & HuffExtraMask;
+        size_t length = here.val + br_peek(br, extra);
+        br_drop(br, extra);
+
+        here = br_decode(br, dcode, DstTableBits);
+        if ((here.op & HuffBase) == 0) {
+            msg = "invalid distance code";
+            break;
+        }
+        br_drop(br, here.bits);
+        extra = here.op & HuffExtraMask;
+        const size_t distance = here.val + br_peek(br, extra);
+        br_drop(br, extra);
+
+        if (distance > n) {
+            // the start of the match is in the window before the chunk
+            const size_t back = distance - n;
+            if (back > history) {
+                msg = "invalid distance too far back";
+                break;
+            }
+            const size_t k = length < back ? length : back;
+            for (size_t i = 0; i < k; ++i) {
+                o[n + i] = static_cast<uint16_t>(PLS_Marker + PLS_WindowSize - back + i);
+            }
+            n += k;
+            length -= k;
+        }
+        const uint16_t *from = o + n - distance;
+        for (size_t i = 0; i < length; ++i) {
+            o[n + i] = from[i];
+        }
+        n += length;
+    }
+    *n_ = n;
+    return msg;
+}
+
+// Decodes blocks into `chunk` as described for `PLS_decode_chunk`, giving up
+// between blocks once `*cancel` is set, if given.
+static const char *decode_chunk(bit_reader *br, uint64_t stop, size_t limit, size_t history,
+                                const std::atomic<bool> *cancel, PLS_chunk *chunk) {
+    huff_entry lits[LitTableSize];
+    huff_entry dsts[DstTableSize];
+    const fixed_tables &fixed = get_fixed_tables();
+    const char *msg = nullptr;
+    size_t n = 0;
+
+    chunk->begin = br_tell(br);
+    chunk->final = false;
+    chunk->out.clear();
+    for (;;) {
+        if (!br_refill(br)) {
+            msg = "unexpected end of input";
+            break;
+        }
+        const bool final = br_peek(br, 1) != 0;
+        const uint64_t type = (br->buff >> 1) & 3;
+        br_drop(br, 3);
+        if (type == 0) {
+            br_drop(br, br->bits & 7);
+            if ((br->buff & 0xFFFFu) != (((br->buff >> 16) & 0xFFFFu) ^ 0xFFFFu)) {
+                msg = "invalid stored block lengths";
+                break;
+            }
+            const size_t length = br->buff & 0xFFFFu;
+            br_drop(br, 32);
+            const size_t pos = br_tell(br) / 8;
+            if (length > br->size || pos > br->size - length) {
+                msg = "unexpected end of input";
+                break;
+            }
+            chunk->out.resize(n + length);
+            for (size_t i = 0; i < length; ++i) {
+                chunk->out[n + i] = br->data[pos + i];
+            }
+            n += length;
+            br_seek(br, (pos + length) * 8);
+        } else if (type == 1) {
+            msg = decode_huffman_block(br, fixed.lits, fixed.dsts, history, chunk, &n);
+        } else if (type == 2) {
+            msg = read_dynamic_header(br, lits, dsts);
+            if (msg == nullptr) {
+                msg = decode_huffman_block(br, lits, dsts, history, chunk, &n);
+            }
+        } else {
+            msg = "invalid block type";
+        }
+        if (msg != nullptr) {
+            break;
+        }
+        if (br_tell(br) > br->size * 8) {
+            msg = "unexpected end of input";
+            break;
+        }
+        if (final) {
+            chunk->final = true;
+            break;
+        }
+        if (br_tell(br) >= stop || n >= limit) {
+            break;
+        }
+        if (cancel && cancel->load(std::memory_order_relaxed)) {
+            msg = "cancelled";
+            break;
+        }
+    }
+    chunk->out.resize(n);
+    chunk->end = br_tell(br);
+    return msg;
+}
+
+int PLS_decode_chunk(const Bytef *data, size_t size, uint64_t begin, uint64_t stop, size_t limit, size_t history,
+                     PLS_chunk *chunk, const char **msg) {
+    bit_reader br = {data, size, 0, 0, 0};
+    br_seek(&br, begin);
+    *msg = decode_chunk(&br, stop, limit, history, nullptr, chunk);
+    return *msg == nullptr ? Z_OK : Z_DATA_ERROR;
+}
+
+bool PLS_find_chunk(const Bytef *data, size_t size, uint64_t from, uint64_t to, uint64_t stop, size_t limit,
+                    const std::atomic<bool> *cancel, PLS_chunk *chunk) {
+    huff_entry lits[LitTableSize];
+    huff_entry dsts[DstTableSize];
+    bit_reader br = {data, size, 0, 0, 0};
+    if (to > size * 8) {
+        to = size * 8;
+    }
+    br_seek(&br, from);
+    for (uint64_t pos = from; pos < to && !cancel->load(std::memory_order_relaxed); ++pos) {
+        // BFINAL 0 and BTYPE 2 before reading the rest of the header
+        if ((br.buff & 7) == 4) {
+            bit_reader hdr = br;
+            br_drop(&hdr, 3);
+            if (read_dynamic_header(&hdr, lits, dsts) == nullptr) {
+                bit_reader blk = br;
+                if (decode_chunk(&blk, stop, limit, PLS_WindowSize, cancel, chunk) == nullptr) {
+                    return true;
+                }
+            }
+        }
+        br_drop(&br, 1);
+        if (br.bits < 56) {
+            br_refill(&br);
+        }
+    }
+    chunk->out.clear();
+    return false;
+}
+
+bool PLS_resolve_chunk(const PLS_chunk *chunk, const Bytef *window, size_t wsize, Bytef *dst) {
+    // markers index a full window, of which only the last `wsize` bytes exist
+    const size_t missing = PLS_WindowSize - wsize;
+    const uint16_t *in = chunk->out.data();
+    const size_t n = chunk->out.size();
+    for (size_t i = 0; i < n; ++i) {
+        const uint16_t sym = in[i];
+        if (sym < PLS_Marker) {
+            dst[i] = static_cast<Bytef>(sym);
+        } else {
+            const size_t k = sym - PLS_Marker;
+            if (k < missing) {
+                return false;
+            }
+            dst[i] = window[k - missing];
+        }
+    }
+    return true;
+}
+
 #endif
@@ -0,0 +1,67 @@
+// Checks calc_crc32, whichever kernel it picks on this cpu, against the table
+// path and zlib over odd lengths and alignments, and that crc32_combine and
+// calc_crc32_parallel give the crc of the whole buffer.
+
+#include <cstdio>
+#include <vector>
+
+#include "crc32.h"
+#include "zlib.h"
+
+static int failures = 0;
+
+static void expect(uint32_t got, uint32_t want, const char *what, size_t a, size_t b) {
+    if (got != want) {
+        fprintf(stderr, "%s (%zu, %zu): got %08x, expected %08x\n", what, a, b, got, want);
+        ++failures;
+    }
+}
+
+int main() {
+    // enough for several chunks of calc_crc32_parallel, and not a multiple of 16
+    std::vector<uint8_t> buf((3u << 20) + 7);
+    uint32_t x = 12345;
+    for (auto &c : buf) {
+        x = x * 1103515245 + 12345;
+        c = static_cast<uint8_t>(x >> 16);
+    }
+    const uint8_t *p = buf.data();
+
+    // short buffers at every alignment, around the 16 byte steps of the kernels
+    for (size_t align = 0; align < 16; ++align) {
+        for (size_t len = 0; len <= 300; ++len) {
+            const uint32_t want = static_cast<uint32_t>(crc32(0, p + align, static_cast<uInt>(len)));
+            expect(calc_crc32_table(0, p + align, len), want, "calc_crc32_table", align, len);
+            expect(calc_crc32(0, p + align, len), want, "calc_crc32", align, len);
+        }
+    }
+    const size_t lengths[] = {1021, 4095, 4097, 65537, 1000003, buf.size() - 3};
+    for (size_t len : lengths) {
+        const uint32_t want = static_cast<uint32_t>(crc32(0xdeadbeef, p + 3, static_cast<uInt>(len)));
+        expect(calc_crc32_table(0xdeadbeef, p + 3, len), want, "calc_crc32_table", 3, len);
+        expect(calc_crc32(0xdeadbeef, p + 3, len), want, "calc_crc32", 3, len);
+    }
+
+    const uint32_t whole = calc_crc32(0, p, buf.size());
+    const size_t splits[] = {0, 1, 15, 16, 17, 4099, buf.size() / 2 + 1, buf.size() - 1, buf.size()};
+    for (size_t split : splits) {
+        const uint32_t a = calc_crc32(0, p, split);
+        const uint32_t b = calc_crc32(0, p + split, buf.size() - split);
+        expect(crc32_combine(a, b, buf.size() - split), whole, "crc32_combine", split, buf.size() - split);
+    }
+
+    const size_t sizes[] = {0, 1, (1u << 20) - 1, (2u << 20) + 3, buf.size()};
+    for (size_t len : sizes) {
+        const uint32_t want = calc_crc32(0x12345678, p, len);
+        for (unsigned nthreads = 0; nthreads <= 5; ++nthreads) {
+            expect(calc_crc32_parallel(0x12345678, p, len, nthreads), want, "calc_crc32_parallel", len, nthreads);
+        }
+    }
+
+    if (failures) {
+        fprintf(stderr, "%d crc32 checks failed\n", failures);
+        return 1;
+    }
+    printf("crc32 checks passed\n");
+    return 0;
+}
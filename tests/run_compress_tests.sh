@@ -29,6 +29,7 @@ else
 fi;
 
 COMPRESS=${BUILD}/compress
+INFLATE=${BUILD}/inflate
 
 ninja -C ${BUILD} || die "Failed to compile"
 
@@ -50,12 +51,42 @@ run_test() {
     diff $INPUT $GUNZIP_OUTPUT || die "Diff failed"
     rm -f $GUNZIP_OUTPUT
 
+    # the optimal parser
+    $PROG --level=10 $INPUT $OUTPUT > /dev/null 2> /dev/null || die "Failed to compress $INPUT with $PROG"
+    gunzip $OUTPUT || die "Failed to inflate $INPUT"
+    diff $INPUT $GUNZIP_OUTPUT || die "Diff failed"
+    rm -f $GUNZIP_OUTPUT
+
+    echo " Passed!"
+}
+
+# -p N compresses the input in 128 KiB chunks on N threads, among the test
+# files are ones smaller than a chunk and test10.txt, exactly 8 of them
+run_parallel_test() {
+    PROG=$1
+    BASENAME=$2
+    INPUT=${TESTDIR}/${BASENAME}.txt
+    OUTPUT=${BUILD}/${BASENAME}.txt.gz
+    INFLATE_OUTPUT=${BUILD}/${BASENAME}.output
+    echo -n "$BASENAME -p..."
+
+    for N in 1 2 4;
+    do
+        $PROG -p $N $INPUT $OUTPUT > /dev/null 2> /dev/null || die "Failed to compress $INPUT with $PROG -p $N"
+        gunzip -c $OUTPUT > $INFLATE_OUTPUT || die "Failed to gunzip $INPUT compressed with -p $N"
+        diff $INPUT $INFLATE_OUTPUT || die "Diff failed with gunzip for -p $N"
+        $INFLATE $OUTPUT $INFLATE_OUTPUT > /dev/null 2> /dev/null || die "Failed to inflate $INPUT compressed with -p $N"
+        diff $INPUT $INFLATE_OUTPUT || die "Diff failed with inflate for -p $N"
+        rm -f $OUTPUT $INFLATE_OUTPUT
+    done
+
     echo " Passed!"
 }
 
 if [[ $# -gt 2 ]];
 then
     run_test $COMPRESS $3
+    run_parallel_test $COMPRESS $3
     exit 0;
 fi;
 
@@ -65,6 +96,7 @@ test23 test24 test25 test26 blank)
 for input in ${TESTS[@]};
 do
     run_test $COMPRESS $input
+    run_parallel_test $COMPRESS $input
 done
 
 echo "Passed all tests!"
@@ -25,6 +25,7 @@ fi;
 
 PLZIP=${BUILD}/plzip
 INFLATE=${BUILD}/inflate
+INFLATE_ZLIB=${BUILD}/inflate_zlib
 
 ninja -C ${BUILD} || die "Failed to compile"
 
@@ -50,6 +51,9 @@ run_test() {
     gzip -c $ORIG > $COMPRESSED || die "Failed to compress with gzip"
     run_inflate $PLZIP $2
     run_inflate $INFLATE $2
+    run_inflate "$INFLATE -p 4" $2
+    run_inflate $INFLATE_ZLIB $2
+    run_inflate "$INFLATE_ZLIB -p 4" $2
     echo ""
     rm -f $COMPRESSED
 }
@@ -68,5 +72,140 @@ do
     run_test $input
 done
 
+# inverts the byte at offset $2 of file $1
+corrupt() {
+    local byte=$(od -An -tu1 -j $2 -N1 $1)
+    printf "\\$(printf %03o $((byte ^ 255)))" | dd of=$1 bs=1 seek=$2 conv=notrunc 2> /dev/null
+}
+
+# a large member, which -p N decodes in pieces, and one after it, between
+# small ones
+LARGE=${BUILD}/large.txt
+head -c 12000000 /dev/urandom | base64 > $LARGE || die "Failed to make $LARGE"
+# and one that compresses so well that it isn't, but whose output is more
+# than a member decoded on its own thread holds
+ZEROS=${BUILD}/zeros.txt
+head -c 40000000 /dev/zero > $ZEROS || die "Failed to make $ZEROS"
+ORIG=${BUILD}/multi.txt
+COMPRESSED=${BUILD}/multi.txt.gz
+OUTPUT=${BUILD}/multi.output
+rm -f $ORIG $COMPRESSED
+for input in ${TESTS[@]} zeros large large;
+do
+    if [[ $input == large ]];
+    then
+        TEST=$LARGE
+    elif [[ $input == zeros ]];
+    then
+        TEST=$ZEROS
+    else
+        TEST=${TESTDIR}/${input}.txt
+    fi;
+    cat $TEST >> $ORIG
+    gzip -c $TEST >> $COMPRESSED || die "Failed to compress with gzip"
+done
+gzip -c ${TESTDIR}/test1.txt >> $COMPRESSED
+cat ${TESTDIR}/test1.txt >> $ORIG
+echo -n "multi-member... "
+run_inflate $INFLATE 0
+run_inflate "$INFLATE -p 4" 0
+run_inflate $INFLATE_ZLIB 0
+run_inflate "$INFLATE_ZLIB -p 4" 0
+echo ""
+
+# --offset X --length Y must write bytes X to X + Y of the output, or up to
+# the end of it
+run_range() {
+    $INFLATE --offset $1 --length $2 $COMPRESSED $OUTPUT > /dev/null 2> /dev/null || die "Failed to extract $1 $2"
+    tail -c +$(($1 + 1)) $ORIG | head -c $2 | cmp -s - $OUTPUT || die "Diff failed for range $1 $2"
+    rm -f $OUTPUT
+}
+
+run_ranges() {
+    local size=$(stat -c %s $ORIG)
+    local first=$(stat -c %s ${TESTDIR}/test1.txt)
+    local large=$(stat -c %s $LARGE)
+    run_range 0 100
+    # across the end of the first member, the large ones and the last one
+    run_range $((first - 10)) 20
+    run_range $((size - 2 * large - 1000)) 3000000
+    run_range $((size - large - 5000)) 10000
+    run_range $((size - 100)) 1000
+    # past the end of the output
+    run_range $size 100
+    run_range $((size + 1000)) 100
+    echo -n " Passed."
+}
+
+echo -n "index... "
+for args in "--index 0" "--index abc" "--index 99999999999" "-p 0" "-p 4x";
+do
+    $INFLATE $args $COMPRESSED $OUTPUT > /dev/null 2> /dev/null && die "Accepted $args"
+done
+rm -f ${COMPRESSED}.idx
+$INFLATE --index 1 $COMPRESSED $OUTPUT > /dev/null 2> /dev/null || die "Failed to index $COMPRESSED"
+diff $ORIG $OUTPUT > /dev/null || die "Diff failed"
+[[ -f ${COMPRESSED}.idx ]] || die "No index written"
+run_ranges
+# an index of a different file of the same size must not be used
+cp $COMPRESSED ${BUILD}/other.txt.gz
+corrupt ${BUILD}/other.txt.gz 4
+$INFLATE --index 1 ${BUILD}/other.txt.gz $OUTPUT > /dev/null 2> /dev/null || die "Failed to index other.txt.gz"
+mv ${BUILD}/other.txt.gz.idx ${COMPRESSED}.idx
+run_ranges
+# nor does it need one
+rm -f ${COMPRESSED}.idx ${BUILD}/other.txt.gz
+run_ranges
+echo ""
+
+# data after the last member, like zero padding, is ignored in every mode
+echo -n "trailing zeros... "
+head -c 1000 /dev/zero >> $COMPRESSED
+run_inflate $INFLATE 0
+run_inflate "$INFLATE -p 4" 0
+run_inflate $INFLATE_ZLIB 0
+run_inflate "$INFLATE_ZLIB -p 4" 0
+rm -f ${COMPRESSED}.idx
+run_inflate "$INFLATE --index 1" 0
+run_ranges
+rm -f ${COMPRESSED}.idx
+echo ""
+
+# these must fail, not write a partial or wrong output and exit 0
+run_bad() {
+    for PROG in $INFLATE "$INFLATE -p 4" $INFLATE_ZLIB "$INFLATE_ZLIB -p 4";
+    do
+        $PROG $1 $OUTPUT > /dev/null 2> /dev/null && die "$PROG accepted $2"
+    done
+    echo -n " Passed."
+    rm -f $OUTPUT
+}
+
+echo -n "bad input... "
+BAD=${BUILD}/bad.txt.gz
+for input in test1 large;
+do
+    if [[ $input == large ]];
+    then
+        gzip -c $LARGE > $COMPRESSED
+    else
+        gzip -c ${TESTDIR}/${input}.txt > $COMPRESSED
+    fi;
+    size=$(stat -c %s $COMPRESSED)
+    head -c $((size / 2)) $COMPRESSED > $BAD
+    run_bad $BAD "a truncated $input"
+    head -c $((size - 1)) $COMPRESSED > $BAD
+    run_bad $BAD "$input without the end of its trailer"
+    cp $COMPRESSED $BAD
+    corrupt $BAD $((size - 8))
+    run_bad $BAD "$input with a bad crc"
+    cp $COMPRESSED $BAD
+    corrupt $BAD $((size - 4))
+    run_bad $BAD "$input with a bad size"
+done
+run_bad ${TESTDIR}/bad_code_lengths.gz "more code lengths than codes"
+echo ""
+rm -f $LARGE $ZEROS $ORIG $COMPRESSED $BAD
+
 echo "Passed all tests!"
 exit 0